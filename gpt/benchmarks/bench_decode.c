@@ -0,0 +1,93 @@
+// 解码速度对比: 每步重新跑整个前缀的 gpt2_forward 和用 KV cache 的
+// gpt2_forward_cached，前缀长度 8、64、512
+// 编译: gcc -O2 -I. -o bench_decode benchmarks/bench_decode.c -lm -lpthread
+// 运行: ./bench_decode [checkpoint] [steps]（默认 gpt2_124M.bin，每个前缀生成 4 个 token）
+// 设置 GPT_PROFILE 时，每个前缀之后再打印两种解码各层的耗时（stderr）
+
+#define main gpt_main
+#include "gpt.c"
+#undef main
+
+#include <sys/time.h>
+
+// 获取时间（秒）
+static double get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+int main(int argc, char** argv) {
+    pool_start();
+    profiling = getenv("GPT_PROFILE") != NULL;
+
+    GPT2 model;
+    gpt2_build_from_checkpoint(&model, argc > 1 ? argv[1] : "gpt2_124M.bin");
+    int steps = argc > 2 ? atoi(argv[2]) : 4;
+    int V = model.config.vocab_size;
+    int prefixes[] = {8, 64, 512};
+
+    printf("%8s %6s %14s %14s %14s %8s\n",
+           "prefix", "steps", "prefill (s)", "full (tok/s)", "cached (tok/s)", "same");
+    for (int i = 0; i < 3; i++) {
+        int P = prefixes[i];
+        int n = P + steps;
+        if (n > model.config.max_seq_len) {
+            break;
+        }
+        int* full = (int*)malloc(n * sizeof(int));
+        int* cached = (int*)malloc(n * sizeof(int));
+        // 固定的伪随机前缀
+        for (int t = 0; t < P; t++) {
+            full[t] = cached[t] = (t * 7919 + 13) % V;
+        }
+
+        // 原来的做法: 每个新 token 都重新计算整个前缀
+        profile_reset();
+        double start = get_time();
+        for (int t = P; t < n; t++) {
+            gpt2_forward(&model, full, 1, t);
+            full[t] = sample_mult(model.acts.probs + (t-1) * V, V);
+        }
+        double full_time = get_time() - start;
+        double full_layers[NUM_LAYER_KINDS];
+        memcpy(full_layers, layer_time, sizeof(layer_time));
+
+        // KV cache: 前缀只跑一次，之后每步只算最新的位置
+        gpt2_kv_init(&model, n);
+        start = get_time();
+        float* probs = gpt2_forward_cached(&model, cached, P);
+        double prefill_time = get_time() - start;
+        cached[P] = sample_mult(probs, V);
+        profile_reset();
+        start = get_time();
+        for (int t = P + 1; t < n; t++) {
+            probs = gpt2_forward_cached(&model, cached, t);
+            cached[t] = sample_mult(probs, V);
+        }
+        double cached_time = get_time() - start;
+
+        int same = memcmp(full + P, cached + P, steps * sizeof(int)) == 0;
+        // 第一个新 token 算在 prefill 里，所以 cached 只数后面的 steps - 1 个
+        printf("%8d %6d %14.3f %14.2f %14.2f %8s\n", P, steps, prefill_time,
+               steps / full_time, steps > 1 ? (steps - 1) / cached_time : 0.0,
+               same ? "yes" : "NO");
+        fflush(stdout);
+        if (profiling) {
+            double cached_layers[NUM_LAYER_KINDS];
+            memcpy(cached_layers, layer_time, sizeof(layer_time));
+            fprintf(stderr, "\nprefix %d, full:\n", P);
+            memcpy(layer_time, full_layers, sizeof(layer_time));
+            profile_print(stderr);
+            fprintf(stderr, "prefix %d, cached:\n", P);
+            memcpy(layer_time, cached_layers, sizeof(layer_time));
+            profile_print(stderr);
+            fprintf(stderr, "\n");
+        }
+        free(full);
+        free(cached);
+    }
+
+    gpt2_free(&model);
+    return 0;
+}
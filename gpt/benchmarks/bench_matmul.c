@@ -0,0 +1,109 @@
+// matmul 内核对比: 原来逐行的标量点积、分块的标量内核和 AVX2/FMA 内核，
+// 形状取 GPT-2 small 的 768x2304（qkv）、768x3072（fc）和 3072x768（fcproj），
+// 每个任务 1 行（解码）和 MM_ROWS 行两种情况，单线程
+// 编译: gcc -O2 -I. -o bench_matmul benchmarks/bench_matmul.c -lm -lpthread
+// 运行: ./bench_matmul
+
+#define main gpt_main
+#include "gpt.c"
+#undef main
+
+#include <sys/time.h>
+
+// 获取时间（秒）
+static double get_time() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// 最早逐行计算的标量内核
+static void matmul_rows_naive(float* out, const float* inp, const float* weight, const float* bias,
+                              int R, int C, int OC, int o_begin, int o_end) {
+    for (int r = 0; r < R; r++) {
+        for (int o = o_begin; o < o_end; o++) {
+            float val = (bias != NULL) ? bias[o] : 0.0f;
+            const float* wrow = weight + o*C;
+            for (int i = 0; i < C; i++) {
+                val += inp[r*C + i] * wrow[i];
+            }
+            out[r*OC + o] = val;
+        }
+    }
+}
+
+typedef void (*kernel_t)(float*, const float*, const float*, const float*, int, int, int, int, int);
+
+// 重复运行至少 0.5 秒，返回 GFLOP/s
+static double gflops(kernel_t kernel, float* out, const float* inp, const float* weight,
+                     const float* bias, int R, int C, int OC) {
+    int reps = 0;
+    double start = get_time(), elapsed;
+    do {
+        kernel(out, inp, weight, bias, R, C, OC, 0, OC);
+        reps++;
+        elapsed = get_time() - start;
+    } while (elapsed < 0.5);
+    return 2.0 * R * C * OC * reps / elapsed / 1e9;
+}
+
+static float max_diff(const float* a, const float* b, int n) {
+    float d = 0.0f;
+    for (int i = 0; i < n; i++) {
+        float e = fabsf(a[i] - b[i]);
+        if (e > d) d = e;
+    }
+    return d;
+}
+
+int main() {
+    int shapes[][2] = {{768, 2304}, {768, 3072}, {3072, 768}};  // C x OC
+    int rows[] = {1, MM_ROWS};
+#if defined(__x86_64__)
+    int avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+
+    printf("%6s %6s %4s %10s %10s %10s %10s\n",
+           "C", "OC", "R", "naive", "scalar", "avx2", "max diff");
+    for (int s = 0; s < 3; s++) {
+        int C = shapes[s][0], OC = shapes[s][1];
+        float* weight = (float*)malloc((size_t)OC * C * sizeof(float));
+        float* bias = (float*)malloc(OC * sizeof(float));
+        float* inp = (float*)malloc((size_t)MM_ROWS * C * sizeof(float));
+        float* ref = (float*)malloc((size_t)MM_ROWS * OC * sizeof(float));
+        float* res = (float*)malloc((size_t)MM_ROWS * OC * sizeof(float));
+        unsigned int seed = 1;
+        for (size_t i = 0; i < (size_t)OC * C; i++) {
+            seed = seed * 1103515245 + 12345;
+            weight[i] = ((seed >> 8) & 0xffff) / 65536.0f - 0.5f;
+        }
+        for (int i = 0; i < OC; i++) bias[i] = i * 0.001f;
+        for (int i = 0; i < MM_ROWS * C; i++) inp[i] = (i % 97) * 0.01f - 0.5f;
+
+        for (int k = 0; k < 2; k++) {
+            int R = rows[k];
+            double naive = gflops(matmul_rows_naive, ref, inp, weight, bias, R, C, OC);
+            double scalar = gflops(matmul_rows_scalar, res, inp, weight, bias, R, C, OC);
+            if (max_diff(ref, res, R * OC) != 0.0f) {
+                printf("scalar kernel differs from the plain loop\n");
+                return 1;
+            }
+            double simd = 0.0;
+            float diff = 0.0f;
+#if defined(__x86_64__)
+            if (avx2) {
+                simd = gflops(matmul_rows_avx2, res, inp, weight, bias, R, C, OC);
+                diff = max_diff(ref, res, R * OC);
+            }
+#endif
+            printf("%6d %6d %4d %10.2f %10.2f %10.2f %10.2g\n", C, OC, R, naive, scalar, simd, diff);
+            fflush(stdout);
+        }
+        free(weight);
+        free(bias);
+        free(inp);
+        free(ref);
+        free(res);
+    }
+    return 0;
+}
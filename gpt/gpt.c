@@ -8,104 +8,318 @@
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "thread.h"
 #include "thread-sync.h"
 
-int THREADS_WORKING = 0, THREADS_CAN_BE_FREED = 0;
-
-float* out;
-const float* inp;
-const float* weight;
-const float* bias;
-int b = -1, t = -1, B, T, C, OC;
-int head = 0, tail = -1;
-mutex_t lk = MUTEX_INIT();
-cond_t cv = COND_INIT();
-
-#define Q_SIZE 16
-#define QUEUE_EMPTY (tail == -1)
-#define QUEUE_FULL (!QUEUE_EMPTY && (tail + 1) % Q_SIZE == head)
-#define CAN_PRODUCE (THREADS_WORKING && !QUEUE_FULL && !ALL_DONE)
-#define CAN_CONSUME (THREADS_WORKING && !QUEUE_EMPTY)
-#define ALL_DONE (b >= B)
-
-typedef struct {
-    float * out_bt, * inp_bt;
-} Task;
-Task Tasks[Q_SIZE];
+// ----------------------------------------------------------------------------
+// matmul kernels: out[r,o] = bias[o] + inp[r,:] . weight[o,:] for R rows
+// and the output channels o in [o_begin, o_end)
+// inp is (R,C), weight is (OC,C), out is (R,OC)
+
+// rows per kernel call: each weight row loaded is reused for all of them
+#define MM_ROWS 8
+
+// weight rows per cache tile: a tile is streamed in once and stays in L2
+// while every row of the call goes over it
+#define MM_OC_TILE 64
+
+// one mr x nr micro-tile of the portable kernel. every dot product is
+// still summed in order from the bias, so results match the plain loop bit
+// for bit; the blocking only gives the adds more independent chains
+static inline __attribute__((always_inline))
+void matmul_tile_scalar(float* out, const float* inp, const float* weight, const float* bias,
+                        int C, int OC, int mr, int nr) {
+    float acc[4][8];
+    for (int r = 0; r < mr; r++) {
+        for (int j = 0; j < nr; j++) {
+            acc[r][j] = (bias != NULL) ? bias[j] : 0.0f;
+        }
+    }
+    for (int i = 0; i < C; i++) {
+        for (int r = 0; r < mr; r++) {
+            float x = inp[r * C + i];
+            for (int j = 0; j < nr; j++) {
+                acc[r][j] += x * weight[j * C + i];
+            }
+        }
+    }
+    for (int r = 0; r < mr; r++) {
+        for (int j = 0; j < nr; j++) {
+            out[r * OC + j] = acc[r][j];
+        }
+    }
+}
 
-void T_PRODUCER() {
-    while(1) {
-        mutex_lock(&lk);
+void matmul_rows_scalar(float* out, const float* inp, const float* weight, const float* bias,
+                        int R, int C, int OC, int o_begin, int o_end) {
+    for (int o0 = o_begin; o0 < o_end; o0 += MM_OC_TILE) {
+        int o1 = o0 + MM_OC_TILE < o_end ? o0 + MM_OC_TILE : o_end;
+        for (int r0 = 0; r0 < R; r0 += 4) {
+            int mr = R - r0 < 4 ? R - r0 : 4;
+            int step = mr == 1 ? 8 : 4;
+            for (int o = o0; o < o1; o += step) {
+                int nr = o1 - o < step ? o1 - o : step;
+                float* out_ro = out + r0 * OC + o;
+                const float* inp_r = inp + r0 * C;
+                const float* weight_o = weight + o * C;
+                const float* bias_o = (bias != NULL) ? bias + o : NULL;
+                if (nr < step) {
+                    matmul_tile_scalar(out_ro, inp_r, weight_o, bias_o, C, OC, mr, nr);
+                } else if (mr == 4) {
+                    matmul_tile_scalar(out_ro, inp_r, weight_o, bias_o, C, OC, 4, 4);
+                } else if (mr == 1) {
+                    matmul_tile_scalar(out_ro, inp_r, weight_o, bias_o, C, OC, 1, 8);
+                } else {
+                    matmul_tile_scalar(out_ro, inp_r, weight_o, bias_o, C, OC, mr, 4);
+                }
+            }
+        }
+    }
+}
 
-        while (!CAN_PRODUCE) {
-            if(THREADS_CAN_BE_FREED) {
-                cond_broadcast(&cv);
-                mutex_unlock(&lk);
-                return;
+#if defined(__x86_64__)
+// one mr x nr micro-tile, 8 floats of C at a time with FMA. mr and nr are
+// constants at every hot call site, so the accumulators live in registers
+static inline __attribute__((always_inline, target("avx2,fma")))
+void matmul_tile_avx2(float* out, const float* inp, const float* weight, const float* bias,
+                      int C, int OC, int mr, int nr) {
+    __m256 acc[4][8];
+    for (int r = 0; r < mr; r++) {
+        for (int j = 0; j < nr; j++) {
+            acc[r][j] = _mm256_setzero_ps();
+        }
+    }
+    int i = 0;
+    for (; i + 8 <= C; i += 8) {
+        __m256 w[8];
+        for (int j = 0; j < nr; j++) {
+            w[j] = _mm256_loadu_ps(weight + j * C + i);
+        }
+        for (int r = 0; r < mr; r++) {
+            __m256 x = _mm256_loadu_ps(inp + r * C + i);
+            for (int j = 0; j < nr; j++) {
+                acc[r][j] = _mm256_fmadd_ps(x, w[j], acc[r][j]);
             }
-            if(ALL_DONE && QUEUE_EMPTY) {
-                THREADS_WORKING = 0;
-                cond_broadcast(&cv);
+        }
+    }
+    for (int r = 0; r < mr; r++) {
+        for (int j = 0; j < nr; j++) {
+            // horizontal sum of the 8 lanes, then the leftover columns
+            __m128 v = _mm_add_ps(_mm256_castps256_ps128(acc[r][j]),
+                                  _mm256_extractf128_ps(acc[r][j], 1));
+            v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+            v = _mm_add_ss(v, _mm_movehdup_ps(v));
+            float val = _mm_cvtss_f32(v);
+            for (int k = i; k < C; k++) {
+                val += inp[r * C + k] * weight[j * C + k];
             }
-            cond_wait(&cv, &lk);
+            out[r * OC + j] = val + ((bias != NULL) ? bias[j] : 0.0f);
         }
+    }
+}
 
-        // tail == -1 i.e. queue is empty
-        tail = (tail + 1) % Q_SIZE;
-        Tasks[tail].out_bt = out + b * T * OC + t * OC;
-        Tasks[tail].inp_bt = inp + b * T * C + t * C;
-
-        cond_broadcast(&cv);
-        mutex_unlock(&lk);
+// up to 12 accumulators: 4 rows x 3 channels down to 1 row x 8 channels
+__attribute__((target("avx2,fma")))
+void matmul_rows_avx2(float* out, const float* inp, const float* weight, const float* bias,
+                      int R, int C, int OC, int o_begin, int o_end) {
+    for (int o0 = o_begin; o0 < o_end; o0 += MM_OC_TILE) {
+        int o1 = o0 + MM_OC_TILE < o_end ? o0 + MM_OC_TILE : o_end;
+        for (int r0 = 0; r0 < R; r0 += 4) {
+            int mr = R - r0 < 4 ? R - r0 : 4;
+            int step = mr == 4 ? 3 : mr == 3 ? 4 : mr == 2 ? 6 : 8;
+            for (int o = o0; o < o1; o += step) {
+                int nr = o1 - o < step ? o1 - o : step;
+                float* out_ro = out + r0 * OC + o;
+                const float* inp_r = inp + r0 * C;
+                const float* weight_o = weight + o * C;
+                const float* bias_o = (bias != NULL) ? bias + o : NULL;
+                if (nr < step) {
+                    matmul_tile_avx2(out_ro, inp_r, weight_o, bias_o, C, OC, mr, nr);
+                } else if (mr == 4) {
+                    matmul_tile_avx2(out_ro, inp_r, weight_o, bias_o, C, OC, 4, 3);
+                } else if (mr == 3) {
+                    matmul_tile_avx2(out_ro, inp_r, weight_o, bias_o, C, OC, 3, 4);
+                } else if (mr == 2) {
+                    matmul_tile_avx2(out_ro, inp_r, weight_o, bias_o, C, OC, 2, 6);
+                } else {
+                    matmul_tile_avx2(out_ro, inp_r, weight_o, bias_o, C, OC, 1, 8);
+                }
+            }
+        }
+    }
+}
+#endif
+
+void matmul_rows(float* out, const float* inp, const float* weight, const float* bias,
+                 int R, int C, int OC, int o_begin, int o_end) {
+#if defined(__x86_64__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    if (has_avx2) {
+        matmul_rows_avx2(out, inp, weight, bias, R, C, OC, o_begin, o_end);
+        return;
+    }
+#endif
+    matmul_rows_scalar(out, inp, weight, bias, R, C, OC, o_begin, o_end);
+}
 
-        if(t < T - 1) t++;
-        else { t = 0; b++; }
+// ----------------------------------------------------------------------------
+// persistent worker pool: parallel_for() splits [0,n) into one contiguous
+// chunk per thread, the calling thread included, and returns once every
+// chunk is done. workers sleep on cv between jobs; a job costs one
+// broadcast to start and a countdown to finish, whatever its size
+
+#define MAX_THREADS 16 // thread.h has room for 16 threads
+
+typedef void (*pool_fn)(void* arg, int start, int end);
+
+struct {
+    int nthreads; // workers + the calling thread
+    int generation; // bumped to start a job
+    int pending; // workers still running the current job
+    int stop;
+    pool_fn fn;
+    void* arg;
+    int n;
+} pool = { .nthreads = 1 };
+mutex_t lk = MUTEX_INIT();
+cond_t cv = COND_INIT(); // a job started, or the pool is stopping
+cond_t done = COND_INIT(); // the last worker finished its chunk
+
+void pool_run(int k) {
+    // chunk k of the current job
+    int start = (int)((long)pool.n * k / pool.nthreads);
+    int end = (int)((long)pool.n * (k + 1) / pool.nthreads);
+    if (start < end) {
+        pool.fn(pool.arg, start, end);
     }
 }
 
-void T_CONSUMER() {
-    while(1) {
+void T_WORKER(int id) {
+    // thread.h numbers threads from 1, which is just our chunk index
+    int seen = 0;
+    while (1) {
         mutex_lock(&lk);
-
-        while (!CAN_CONSUME) {
-            if(THREADS_CAN_BE_FREED) {
-                cond_broadcast(&cv);
-                mutex_unlock(&lk);
-                return;
-            }
-            if(ALL_DONE && QUEUE_EMPTY) {
-                THREADS_WORKING = 0;
-                cond_broadcast(&cv);
-            }
+        while (pool.generation == seen && !pool.stop) {
             cond_wait(&cv, &lk);
         }
-
-        float* out_bt = Tasks[head].out_bt;
-        float* inp_bt = Tasks[head].inp_bt;
-
-        for (int o = 0; o < OC; o++) {
-            float val = (bias != NULL) ? bias[o] : 0.0f;
-            float* wrow = weight + o*C;
-            for (int i = 0; i < C; i++) {
-                val += inp_bt[i] * wrow[i];
-            }
-            out_bt[o] = val;
+        if (pool.stop) {
+            mutex_unlock(&lk);
+            return;
         }
+        seen = pool.generation;
+        mutex_unlock(&lk);
 
-        // if only 1 element in queue
-        if(head == tail) {
-            tail = -1;
-            head = 0;
-        } else {
-            head = (head + 1) % Q_SIZE;
+        pool_run(id);
+
+        mutex_lock(&lk);
+        if (--pool.pending == 0) {
+            cond_signal(&done);
         }
-        cond_broadcast(&cv);
         mutex_unlock(&lk);
     }
 }
 
+void parallel_for(pool_fn fn, void* arg, int n) {
+    if (pool.nthreads == 1 || n < 2) {
+        if (n > 0) { fn(arg, 0, n); }
+        return;
+    }
+    mutex_lock(&lk);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.n = n;
+    pool.pending = pool.nthreads - 1;
+    pool.generation++;
+    cond_broadcast(&cv);
+    mutex_unlock(&lk);
+
+    pool_run(0);
+
+    mutex_lock(&lk);
+    while (pool.pending > 0) {
+        cond_wait(&done, &lk);
+    }
+    mutex_unlock(&lk);
+}
+
+void pool_stop() {
+    mutex_lock(&lk);
+    pool.stop = 1;
+    cond_broadcast(&cv);
+    mutex_unlock(&lk);
+    join();
+}
+
+void pool_start() {
+    // one thread per online CPU, unless GPT_THREADS says otherwise
+    long ncpu = getenv("GPT_THREADS") ? atol(getenv("GPT_THREADS")) : sysconf(_SC_NPROCESSORS_ONLN);
+    pool.nthreads = ncpu < 1 ? 1 : ncpu > MAX_THREADS ? MAX_THREADS : (int)ncpu;
+    for (int i = 1; i < pool.nthreads; i++) {
+        spawn(T_WORKER);
+    }
+    // runs before thread.h's own join() at exit, however main returns
+    atexit(pool_stop);
+}
+
+// ----------------------------------------------------------------------------
+// per-layer timing: with profiling on, TIMED() adds the time of each layer
+// call to its kind, across all transformer blocks
+
+enum {
+    L_ENCODER, L_LAYERNORM, L_QKV, L_ATTENTION, L_ATTPROJ, L_RESIDUAL,
+    L_FC, L_GELU, L_FCPROJ, L_LOGITS, L_SOFTMAX, NUM_LAYER_KINDS
+};
+const char* layer_names[NUM_LAYER_KINDS] = {
+    "encoder", "layernorm", "qkv", "attention", "attproj", "residual",
+    "fc", "gelu", "fcproj", "logits", "softmax"
+};
+int profiling = 0;
+double layer_time[NUM_LAYER_KINDS];
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define TIMED(kind, call) do { \
+        if (profiling) { \
+            double start_ = now_seconds(); \
+            call; \
+            layer_time[kind] += now_seconds() - start_; \
+        } else { \
+            call; \
+        } \
+    } while (0)
+
+void profile_print(FILE* f) {
+    double total = 0.0;
+    for (int i = 0; i < NUM_LAYER_KINDS; i++) {
+        total += layer_time[i];
+    }
+    fprintf(f, "%-10s %10s %7s\n", "layer", "seconds", "share");
+    for (int i = 0; i < NUM_LAYER_KINDS; i++) {
+        fprintf(f, "%-10s %10.4f %6.1f%%\n", layer_names[i], layer_time[i],
+                total > 0.0 ? 100.0 * layer_time[i] / total : 0.0);
+    }
+    fprintf(f, "%-10s %10.4f\n", "total", total);
+}
+
+void profile_reset() {
+    memset(layer_time, 0, sizeof(layer_time));
+}
+
 // ----------------------------------------------------------------------------
 // all the individual layers' forward passes
 // B = batch_size, T = sequence_length, C = channels, V = vocab_size
@@ -177,52 +391,131 @@ void layernorm_forward(float* out, float* mean, float* rstd,
     }
 }
 
-void matmul_forward(float* out_local,
-                    const float* inp_local, const float* weight_local, const float* bias_local,
-                    int B_local, int T_local, int C_local, int OC_local) {
+typedef struct {
+    float* out;
+    const float* inp;
+    const float* weight;
+    const float* bias;
+    int BT, C, OC;
+} MatmulJob;
+
+// output channels [8*start, 8*end) of every row, MM_ROWS rows at a time
+void matmul_chunk(void* arg, int start, int end) {
+    MatmulJob* job = (MatmulJob*)arg;
+    int o_begin = start * 8;
+    int o_end = end * 8 < job->OC ? end * 8 : job->OC;
+    for (int r = 0; r < job->BT; r += MM_ROWS) {
+        int rows = job->BT - r < MM_ROWS ? job->BT - r : MM_ROWS;
+        matmul_rows(job->out + r * job->OC, job->inp + r * job->C, job->weight, job->bias,
+                    rows, job->C, job->OC, o_begin, o_end);
+    }
+}
+
+void matmul_forward(float* out,
+                    const float* inp, const float* weight, const float* bias,
+                    int B, int T, int C, int OC) {
     // most of the running time is spent here and in matmul_backward
     // OC is short for "output channels"
     // inp is (B,T,C), weight is (OC, C), bias is (OC)
     // out will be (B,T,OC)
+    // every thread takes a slice of the output channels for all rows, in
+    // groups of 8 so each slice starts on a whole SIMD tile
+    MatmulJob job = { out, inp, weight, bias, B * T, C, OC };
+    parallel_for(matmul_chunk, &job, (OC + 7) / 8);
+}
 
-    mutex_lock(&lk);
+void attention_head_forward(float* out_bth, float* preatt_bth, float* att_bth,
+                            float* query_t, float* key, float* value, int stride,
+                            int t, int hs, float scale) {
+    // one head of one query position: attends over the keys and values of
+    // positions 0..t, which sit stride floats apart in key and value
+    // pass 1: calculate query dot key and maxval
+    float maxval = -10000.0f; // TODO something better
+    for (int t2 = 0; t2 <= t; t2++) {
+        float* key_t2 = key + t2 * stride;
+
+        // (query_t) dot (key_t2)
+        float val = 0.0f;
+        for (int i = 0; i < hs; i++) {
+            val += query_t[i] * key_t2[i];
+        }
+        val *= scale;
+        if (val > maxval) {
+            maxval = val;
+        }
 
-    out = out_local;
-    inp = inp_local;
-    weight = weight_local;
-    bias = bias_local;
-    B = B_local;
-    T = T_local;
-    C = C_local;
-    OC = OC_local;
-    b = 0;
-    t = 0;
-    head = 0;
-    tail = -1;
-
-    THREADS_WORKING = 1;
+        preatt_bth[t2] = val;
+    }
 
-    cond_broadcast(&cv);
+    // pass 2: calculate the exp and keep track of sum
+    // maxval is being calculated and subtracted only for numerical stability
+    float expsum = 0.0f;
+    for (int t2 = 0; t2 <= t; t2++) {
+        float expv = expf(preatt_bth[t2] - maxval);
+        expsum += expv;
+        att_bth[t2] = expv;
+    }
+    float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
 
-    while(THREADS_WORKING) {
-       cond_wait(&cv, &lk);
+    // pass 3: normalize to get the softmax
+    for (int t2 = 0; t2 <= t; t2++) {
+        att_bth[t2] *= expsum_inv;
     }
 
-    mutex_unlock(&lk);
-    // for (int b = 0; b < B; b++) {
-    //     for (int t = 0; t < T; t++) {
-    //         float* out_bt = out + b * T * OC + t * OC;
-    //         float* inp_bt = inp + b * T * C + t * C;
-    //         for (int o = 0; o < OC; o++) {
-    //             float val = (bias != NULL) ? bias[o] : 0.0f;
-    //             float* wrow = weight + o*C;
-    //             for (int i = 0; i < C; i++) {
-    //                 val += inp_bt[i] * wrow[i];
-    //             }
-    //             out_bt[o] = val;
-    //         }
-    //     }
-    // }
+    // pass 4: accumulate weighted values into the output of attention
+    for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
+    for (int t2 = 0; t2 <= t; t2++) {
+        float* value_t2 = value + t2 * stride;
+        float att_btht2 = att_bth[t2];
+        for (int i = 0; i < hs; i++) {
+            out_bth[i] += att_btht2 * value_t2[i];
+        }
+    }
+}
+
+typedef struct {
+    float* out;
+    float* preatt;
+    float* att;
+    float* inp; // (B, T, 3C); attention_forward_cached: qkv of the new positions
+    float* key; // attention_forward_cached only: (max_len, C) each
+    float* value;
+    int B, T, C, NH; // attention_forward_cached: T new positions
+    int start, max_len; // attention_forward_cached only
+} AttentionJob;
+
+void attention_chunk(void* arg, int start, int end) {
+    // items run over (b, h, k), k fastest. k zigzags over the positions
+    // (0, T-1, 1, T-2, ...) so that any run of items mixes short and long
+    // rows and the threads get about the same amount of work
+    AttentionJob* job = (AttentionJob*)arg;
+    int T = job->T, C = job->C, NH = job->NH;
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+
+    for (int i = start; i < end; i++) {
+        int k = i % T;
+        int h = (i / T) % NH;
+        int b = i / T / NH;
+        int t = k % 2 == 0 ? k / 2 : T - 1 - k / 2;
+
+        float* query_t = job->inp + b * T * C3 + t * C3 + h * hs;
+        float* preatt_bth = job->preatt + b*NH*T*T + h*T*T + t*T;
+        float* att_bth = job->att + b*NH*T*T + h*T*T + t*T;
+        float* key = job->inp + b * T * C3 + h * hs + C; // +C because it's key
+        float* value = job->inp + b * T * C3 + h * hs + C*2; // +C*2 because it's value
+        float* out_bth = job->out + b * T * C + t * C + h * hs;
+
+        attention_head_forward(out_bth, preatt_bth, att_bth,
+                               query_t, key, value, C3, t, hs, scale);
+
+        // causal attention mask. not strictly necessary to set to zero here
+        // only doing this explicitly for debugging and checking to PyTorch
+        for (int t2 = t + 1; t2 < T; t2++) {
+            att_bth[t2] = 0.0f;
+        }
+    }
 }
 
 void attention_forward(float* out, float* preatt, float* att,
@@ -235,71 +528,42 @@ void attention_forward(float* out, float* preatt, float* att,
     // attention is the only layer that mixes information across time
     // every other operation is applied at every (b,t) position independently
     // (and of course, no layer mixes information across batch)
-    int C3 = C*3;
+    // so every (b, t, h) is a separate item for the worker pool
+    AttentionJob job = { .out = out, .preatt = preatt, .att = att, .inp = inp,
+                         .B = B, .T = T, .C = C, .NH = NH };
+    parallel_for(attention_chunk, &job, B * NH * T);
+}
+
+void attention_cached_chunk(void* arg, int start, int end) {
+    // heads [start, end) for all the new positions, in order: a head's
+    // preatt and att rows are reused from one position to the next
+    AttentionJob* job = (AttentionJob*)arg;
+    int C = job->C, NH = job->NH;
     int hs = C / NH; // head size
     float scale = 1.0 / sqrtf(hs);
 
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int h = 0; h < NH; h++) {
-                float* query_t = inp + b * T * C3 + t * C3 + h * hs;
-                float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
-                float* att_bth = att + b*NH*T*T + h*T*T + t*T;
-
-                // pass 1: calculate query dot key and maxval
-                float maxval = -10000.0f; // TODO something better
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-
-                    // (query_t) dot (key_t2)
-                    float val = 0.0f;
-                    for (int i = 0; i < hs; i++) {
-                        val += query_t[i] * key_t2[i];
-                    }
-                    val *= scale;
-                    if (val > maxval) {
-                        maxval = val;
-                    }
-
-                    preatt_bth[t2] = val;
-                }
-
-                // pass 2: calculate the exp and keep track of sum
-                // maxval is being calculated and subtracted only for numerical stability
-                float expsum = 0.0f;
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float expv = expf(preatt_bth[t2] - maxval);
-                    expsum += expv;
-                    att_bth[t2] = expv;
-                }
-                float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
-
-                // pass 3: normalize to get the softmax
-                for (int t2 = 0; t2 < T; t2++) {
-                    if (t2 <= t) {
-                        att_bth[t2] *= expsum_inv;
-                    } else {
-                        // causal attention mask. not strictly necessary to set to zero here
-                        // only doing this explicitly for debugging and checking to PyTorch
-                        att_bth[t2] = 0.0f;
-                    }
-                }
-
-                // pass 4: accumulate weighted values into the output of attention
-                float* out_bth = out + b * T * C + t * C + h * hs;
-                for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
-                    float att_btht2 = att_bth[t2];
-                    for (int i = 0; i < hs; i++) {
-                        out_bth[i] += att_btht2 * value_t2[i];
-                    }
-                }
-            }
+    for (int h = start; h < end; h++) {
+        for (int n = 0; n < job->T; n++) {
+            attention_head_forward(job->out + n * C + h * hs,
+                                   job->preatt + h * job->max_len, job->att + h * job->max_len,
+                                   job->inp + n * 3*C + h * hs, job->key + h * hs, job->value + h * hs,
+                                   C, job->start + n, hs, scale);
         }
     }
 }
 
+void attention_forward_cached(float* out, float* preatt, float* att, float* qkv,
+                              float* key, float* value,
+                              int start, int N, int C, int NH, int max_len) {
+    // qkv is (N, 3C) for positions start..start+N-1, whose keys and values
+    // are already in key and value (max_len, C) along with the earlier ones
+    // preatt, att are (NH, max_len) scratch, out is (N, C)
+    AttentionJob job = { .out = out, .preatt = preatt, .att = att, .inp = qkv,
+                         .key = key, .value = value, .T = N, .C = C, .NH = NH,
+                         .start = start, .max_len = max_len };
+    parallel_for(attention_cached_chunk, &job, NH);
+}
+
 #define GELU_SCALING_FACTOR sqrtf(2.0f / M_PI)
 void gelu_forward(float* out, float* inp, int N) {
     // (approximate) GeLU elementwise non-linearity in the MLP block of Transformer
@@ -369,14 +633,8 @@ typedef struct {
 } ParameterTensors;
 
 // allocate memory for the parameters and point the individual tensors to the right places
-float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes) {
-    size_t num_parameters = 0;
-    for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
-        num_parameters += param_sizes[i];
-    }
-    // malloc all parameters all at once
-    float* params_memory = (float*)malloc(num_parameters * sizeof(float));
-    // assign all the tensors
+void point_parameters(ParameterTensors* params, size_t* param_sizes, float* params_memory) {
+    // the parameters are laid out back to back in params_memory; assign all the tensors
     float** ptrs[] = {
         &params->wte, &params->wpe, &params->ln1w, &params->ln1b, &params->qkvw, &params->qkvb,
         &params->attprojw, &params->attprojb, &params->ln2w, &params->ln2b, &params->fcw, &params->fcb,
@@ -387,7 +645,6 @@ float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes
         *(ptrs[i]) = params_memory_iterator;
         params_memory_iterator += param_sizes[i];
     }
-    return params_memory;
 }
 
 #define NUM_ACTIVATION_TENSORS 23
@@ -445,13 +702,40 @@ typedef struct {
     int channels; // number of channels, e.g. 768
 } GPT2Config;
 
+// key/value cache for incremental decoding: keeps the keys and values of
+// every position already run, so each new token only runs its own row
+// through the layers. the scratch activations hold the new positions of
+// one layer at a time and are reused by every layer
+typedef struct {
+    int max_len; // positions the cache can hold
+    int len; // positions cached so far, i.e. tokens[0..len) of the last call
+    float* key; // (L, max_len, C)
+    float* value; // (L, max_len, C)
+    float* residual; // (max_len, C)
+    float* ln; // (max_len, C)
+    float* ln_mean; // (max_len)
+    float* ln_rstd; // (max_len)
+    float* qkv; // (max_len, 3*C)
+    float* atty; // (max_len, C)
+    float* preatt; // (NH, max_len)
+    float* att; // (NH, max_len)
+    float* proj; // (max_len, C), attproj and fcproj
+    float* fch; // (max_len, 4*C)
+    float* fch_gelu; // (max_len, 4*C)
+    float* logits; // (V), last position only
+    float* probs; // (V)
+    float* memory;
+} KVCache;
+
 typedef struct {
     GPT2Config config;
     // the weights (parameters) of the model, and their sizes
     ParameterTensors params;
     size_t param_sizes[NUM_PARAMETER_TENSORS];
-    float* params_memory;
+    float* params_memory; // points into params_map, read only
     int num_parameters;
+    void* params_map; // the whole checkpoint file, mmap-ed
+    size_t params_map_size;
     // gradients of the weights
     ParameterTensors grads;
     float* grads_memory;
@@ -472,15 +756,24 @@ typedef struct {
     int* inputs; // the input tokens for the current forward pass
     int* targets; // the target tokens for the current forward pass
     float mean_loss; // after a forward pass with targets, will be populated with the mean loss
+    // decode state for gpt2_forward_cached
+    KVCache kv;
 } GPT2;
 
 void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
 
-    // read in model from a checkpoint file
-    FILE *model_file = fopen(checkpoint_path, "rb");
-    if (model_file == NULL) { printf("Error opening model file\n"); exit(1); }
-    int model_header[256];
-    fread(model_header, sizeof(int), 256, model_file);
+    // map the checkpoint file read only: the parameters are used in place, so
+    // startup costs no copy and all gpt processes share the page cache pages
+    int fd = open(checkpoint_path, O_RDONLY);
+    if (fd < 0) { printf("Error opening model file\n"); exit(1); }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < 256 * sizeof(int)) { printf("Bad model file size\n"); exit(1); }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { printf("Error mapping model file\n"); exit(1); }
+    model->params_map = map;
+    model->params_map_size = st.st_size;
+    int* model_header = (int*)map;
     if (model_header[0] != 20240326) { printf("Bad magic model file"); exit(1); }
     if (model_header[1] != 1) { printf("Bad version in model file"); exit(1); }
 
@@ -517,10 +810,10 @@ void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
     }
     model->num_parameters = num_parameters;
 
-    // read in all the parameters from file
-    model->params_memory = malloc_and_point_parameters(&model->params, model->param_sizes);
-    fread(model->params_memory, sizeof(float), num_parameters, model_file);
-    fclose(model_file);
+    // the parameters follow the header in the file
+    if (model->params_map_size < 256 * sizeof(int) + num_parameters * sizeof(float)) { printf("Model file too short\n"); exit(1); }
+    model->params_memory = (float*)(model_header + 256);
+    point_parameters(&model->params, model->param_sizes, model->params_memory);
 
     // other inits
     model->acts_memory = NULL;
@@ -533,6 +826,9 @@ void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
     model->batch_size = 0;
     model->seq_len = 0;
     model->mean_loss = -1.0f; // -1.0f will designate no loss
+    model->kv.memory = NULL;
+    model->kv.max_len = 0;
+    model->kv.len = 0;
 }
 
 void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
@@ -594,7 +890,7 @@ void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
     ParameterTensors params = model->params; // for brevity
     ActivationTensors acts = model->acts;
     float* residual;
-    encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, C); // encoding goes into residual[0]
+    TIMED(L_ENCODER, encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, C)); // encoding goes into residual[0]
     for (int l = 0; l < L; l++) {
 
         residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
@@ -632,21 +928,112 @@ void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
         float* l_residual3 = acts.residual3 + l * B * T * C;
 
         // now do the forward pass
-        layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
-        matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C);
-        attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
-        matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
-        residual_forward(l_residual2, residual, l_attproj, B*T*C);
-        layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
-        matmul_forward(l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4*C);
-        gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
-        matmul_forward(l_fcproj, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C);
-        residual_forward(l_residual3, l_residual2, l_fcproj, B*T*C);
+        TIMED(L_LAYERNORM, layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C));
+        TIMED(L_QKV, matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C));
+        TIMED(L_ATTENTION, attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH));
+        TIMED(L_ATTPROJ, matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C));
+        TIMED(L_RESIDUAL, residual_forward(l_residual2, residual, l_attproj, B*T*C));
+        TIMED(L_LAYERNORM, layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C));
+        TIMED(L_FC, matmul_forward(l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4*C));
+        TIMED(L_GELU, gelu_forward(l_fch_gelu, l_fch, B*T*4*C));
+        TIMED(L_FCPROJ, matmul_forward(l_fcproj, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C));
+        TIMED(L_RESIDUAL, residual_forward(l_residual3, l_residual2, l_fcproj, B*T*C));
     }
     residual = acts.residual3 + (L-1) * B * T * C; // last residual is in residual3
-    layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, C);
-    matmul_forward(acts.logits, acts.lnf, params.wte, NULL, B, T, C, V);
-    softmax_forward(acts.probs, acts.logits, B, T, V);
+    TIMED(L_LAYERNORM, layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, C));
+    TIMED(L_LOGITS, matmul_forward(acts.logits, acts.lnf, params.wte, NULL, B, T, C, V));
+    TIMED(L_SOFTMAX, softmax_forward(acts.probs, acts.logits, B, T, V));
+}
+
+void gpt2_kv_init(GPT2 *model, int max_len) {
+    // allocate the cache for sequences of up to max_len tokens
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int NH = model->config.num_heads;
+    int C = model->config.channels;
+    if (max_len > model->config.max_seq_len) { max_len = model->config.max_seq_len; }
+
+    KVCache* kv = &model->kv;
+    size_t sizes[] = {
+        (size_t)L * max_len * C, (size_t)L * max_len * C, // key, value
+        (size_t)max_len * C, (size_t)max_len * C, max_len, max_len, // residual, ln, ln_mean, ln_rstd
+        (size_t)max_len * 3*C, (size_t)max_len * C, // qkv, atty
+        (size_t)NH * max_len, (size_t)NH * max_len, // preatt, att
+        (size_t)max_len * C, (size_t)max_len * 4*C, (size_t)max_len * 4*C, // proj, fch, fch_gelu
+        V, V // logits, probs
+    };
+    float** ptrs[] = {
+        &kv->key, &kv->value, &kv->residual, &kv->ln, &kv->ln_mean, &kv->ln_rstd,
+        &kv->qkv, &kv->atty, &kv->preatt, &kv->att, &kv->proj, &kv->fch, &kv->fch_gelu,
+        &kv->logits, &kv->probs
+    };
+    size_t total = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        total += sizes[i];
+    }
+    free(kv->memory);
+    kv->memory = (float*)malloc(total * sizeof(float));
+    float* iterator = kv->memory;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        *(ptrs[i]) = iterator;
+        iterator += sizes[i];
+    }
+    kv->max_len = max_len;
+    kv->len = 0;
+}
+
+float* gpt2_forward_cached(GPT2 *model, int* tokens, int T) {
+    // same result as gpt2_forward(model, tokens, 1, T) for the last position,
+    // but only positions kv.len..T-1 run through the layers; the ones before
+    // come from the cache, so tokens[0..kv.len) must not have changed since
+    // the last call (set kv.len = 0 to start over). returns the (V) probs of
+    // position T-1
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int NH = model->config.num_heads;
+    int C = model->config.channels;
+    KVCache* kv = &model->kv;
+    if (kv->memory == NULL || T > kv->max_len || T < 1) {
+        printf("KV cache cannot hold %d tokens\n", T);
+        exit(1);
+    }
+    if (kv->len >= T) { kv->len = T - 1; } // rerun the last one for its probs
+
+    int start = kv->len; // first new position
+    int N = T - start; // number of new positions
+
+    ParameterTensors params = model->params; // for brevity
+    TIMED(L_ENCODER, encoder_forward(kv->residual, tokens + start, params.wte, params.wpe + start * C, 1, N, C));
+    for (int l = 0; l < L; l++) {
+        float* l_key = kv->key + l * kv->max_len * C;
+        float* l_value = kv->value + l * kv->max_len * C;
+
+        TIMED(L_LAYERNORM, layernorm_forward(kv->ln, kv->ln_mean, kv->ln_rstd, kv->residual,
+                                             params.ln1w + l * C, params.ln1b + l * C, 1, N, C));
+        TIMED(L_QKV, matmul_forward(kv->qkv, kv->ln, params.qkvw + l * 3*C * C, params.qkvb + l * 3*C, 1, N, C, 3*C));
+        for (int n = 0; n < N; n++) {
+            memcpy(l_key + (start + n) * C, kv->qkv + n * 3*C + C, C * sizeof(float));
+            memcpy(l_value + (start + n) * C, kv->qkv + n * 3*C + 2*C, C * sizeof(float));
+        }
+        TIMED(L_ATTENTION, attention_forward_cached(kv->atty, kv->preatt, kv->att, kv->qkv, l_key, l_value,
+                                                    start, N, C, NH, kv->max_len));
+        TIMED(L_ATTPROJ, matmul_forward(kv->proj, kv->atty, params.attprojw + l * C * C, params.attprojb + l * C, 1, N, C, C));
+        TIMED(L_RESIDUAL, residual_forward(kv->residual, kv->residual, kv->proj, N*C));
+        TIMED(L_LAYERNORM, layernorm_forward(kv->ln, kv->ln_mean, kv->ln_rstd, kv->residual,
+                                             params.ln2w + l * C, params.ln2b + l * C, 1, N, C));
+        TIMED(L_FC, matmul_forward(kv->fch, kv->ln, params.fcw + l * 4*C * C, params.fcb + l * 4*C, 1, N, C, 4*C));
+        TIMED(L_GELU, gelu_forward(kv->fch_gelu, kv->fch, N*4*C));
+        TIMED(L_FCPROJ, matmul_forward(kv->proj, kv->fch_gelu, params.fcprojw + l * C * 4*C, params.fcprojb + l * C, 1, N, 4*C, C));
+        TIMED(L_RESIDUAL, residual_forward(kv->residual, kv->residual, kv->proj, N*C));
+    }
+    // only the last position's logits are needed
+    float* last = kv->residual + (N-1) * C;
+    TIMED(L_LAYERNORM, layernorm_forward(kv->ln, kv->ln_mean, kv->ln_rstd, last, params.lnfw, params.lnfb, 1, 1, C));
+    TIMED(L_LOGITS, matmul_forward(kv->logits, kv->ln, params.wte, NULL, 1, 1, C, V));
+    TIMED(L_SOFTMAX, softmax_forward(kv->probs, kv->logits, 1, 1, V));
+
+    kv->len = T;
+    return kv->probs;
 }
 
 void gpt2_zero_grad(GPT2 *model) {
@@ -655,7 +1042,7 @@ void gpt2_zero_grad(GPT2 *model) {
 }
 
 void gpt2_free(GPT2 *model) {
-    free(model->params_memory);
+    munmap(model->params_map, model->params_map_size);
     free(model->grads_memory);
     free(model->m_memory);
     free(model->v_memory);
@@ -663,6 +1050,7 @@ void gpt2_free(GPT2 *model) {
     free(model->grads_acts_memory);
     free(model->inputs);
     free(model->targets);
+    free(model->kv.memory);
 }
 
 int sample_mult(float* probabilities, int n) {
@@ -682,10 +1070,8 @@ int sample_mult(float* probabilities, int n) {
 #define GPT2_EOT 50256
 
 int main(int argc, char** argv) {
-    spawn(T_PRODUCER);
-    spawn(T_CONSUMER);
-    spawn(T_CONSUMER);
-    spawn(T_CONSUMER);
+    pool_start();
+    profiling = getenv("GPT_PROFILE") != NULL;
 
     GPT2 model;
     gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
@@ -710,9 +1096,10 @@ int main(int argc, char** argv) {
         }
     }
 
+    // the prompt runs through the layers once, then one new token per step
+    gpt2_kv_init(&model, n);
     for (int t = argc - 1; t < n; t++) {
-        gpt2_forward(&model, tokens, 1, t);
-        float* probs = model.acts.probs + (t-1) * model.config.vocab_size;
+        float* probs = gpt2_forward_cached(&model, tokens, t);
         int next_token = sample_mult(probs, model.config.vocab_size);
         tokens[t] = next_token;
 
@@ -720,10 +1107,11 @@ int main(int argc, char** argv) {
         fflush(stdout);
     }
 
-    gpt2_free(&model);
-
-    THREADS_CAN_BE_FREED = 1;
-    join();
+    // stdout is read token by token (see chat.py), so the table goes to stderr
+    if (profiling) {
+        profile_print(stderr);
+    }
 
+    gpt2_free(&model);
     return 0;
 }
@@ -0,0 +1,229 @@
+// 分配器矩阵基准测试
+// 场景和 compare_malloc.c 相同（顺序、批量、随机大小、碎片化），再加一个
+// 跨线程释放的场景；每个场景由 N 个线程同时运行，输出一行 CSV。
+// 只调用 malloc()/free()，被测分配器由 LD_PRELOAD 决定，见 bench_matrix.sh。
+// 编译: gcc -O2 -o bench_matrix benchmarks/bench_matrix.c -lpthread
+// 运行: ./bench_matrix <scenario> <threads>
+//   输出: scenario,threads,ops,seconds,mops,peak_rss_kb
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define MAX_THREADS 64
+
+// 每个线程的工作量
+#define SEQ_ITERS     5000000
+#define BATCH_SIZE    1000
+#define BATCH_ROUNDS  1000
+#define RANDOM_SLOTS  100
+#define RANDOM_ITERS  2000000
+#define FRAG_PAIRS    500
+#define FRAG_ROUNDS   100
+#define REMOTE_ITERS  1000000
+#define REMOTE_RING   1024  // 必须是 2 的幂
+
+static int nr_threads;
+static pthread_barrier_t start_barrier;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 简单随机数生成器
+static unsigned int simple_rand(unsigned int *seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static void touch(void *ptr, int i) {
+    if (ptr) {
+        *(volatile char *)ptr = (char)i;
+    }
+}
+
+// 场景1: 顺序分配释放 64 字节
+static long run_sequential(int id) {
+    (void)id;
+    for (int i = 0; i < SEQ_ITERS; i++) {
+        void *ptr = malloc(64);
+        touch(ptr, i);
+        free(ptr);
+    }
+    return 2L * SEQ_ITERS;
+}
+
+// 场景2: 先批量分配 128-511 字节，再全部释放
+static long run_batch(int id) {
+    (void)id;
+    static __thread void *ptrs[BATCH_SIZE];
+    for (int r = 0; r < BATCH_ROUNDS; r++) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            ptrs[i] = malloc(128 + (i % 384));
+            touch(ptrs[i], i);
+        }
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            free(ptrs[i]);
+        }
+    }
+    return 2L * BATCH_SIZE * BATCH_ROUNDS;
+}
+
+// 场景3: 随机替换 100 个槽位里的对象，大小 8-1023 字节
+static long run_random(int id) {
+    void *ptrs[RANDOM_SLOTS] = {0};
+    unsigned int seed = 12345 + id;
+    for (int i = 0; i < RANDOM_ITERS; i++) {
+        int idx = simple_rand(&seed) % RANDOM_SLOTS;
+        free(ptrs[idx]);
+        ptrs[idx] = malloc(8 + simple_rand(&seed) % 1016);
+        touch(ptrs[idx], i);
+    }
+    for (int i = 0; i < RANDOM_SLOTS; i++) {
+        free(ptrs[i]);
+    }
+    return 2L * RANDOM_ITERS;
+}
+
+// 场景4: 交替分配大小对象，释放小对象留下空洞，再分配两倍大小的对象
+static long frag_round(size_t small, size_t large) {
+    static __thread void *small_ptrs[FRAG_PAIRS], *large_ptrs[FRAG_PAIRS];
+    for (int i = 0; i < FRAG_PAIRS; i++) {
+        small_ptrs[i] = malloc(small);
+        large_ptrs[i] = malloc(large);
+        touch(small_ptrs[i], i);
+        touch(large_ptrs[i], i);
+    }
+    for (int i = 0; i < FRAG_PAIRS; i++) {
+        free(small_ptrs[i]);
+    }
+    for (int i = 0; i < FRAG_PAIRS / 2; i++) {
+        void *ptr = malloc(small * 2);
+        touch(ptr, i);
+        free(ptr);
+    }
+    for (int i = 0; i < FRAG_PAIRS; i++) {
+        free(large_ptrs[i]);
+    }
+    return 4L * FRAG_PAIRS + FRAG_PAIRS;
+}
+
+static long run_fragmentation(int id) {
+    (void)id;
+    long ops = 0;
+    for (int r = 0; r < FRAG_ROUNDS; r++) {
+        ops += frag_round(32, 256);
+        ops += frag_round(2048, 8192);
+    }
+    return ops;
+}
+
+// 场景5: 每个线程分配的对象都交给下一个线程释放（单生产者单消费者环形队列）；
+// 只有一个线程时就是自己分配自己释放
+static struct ring {
+    _Alignas(64) void *slots[REMOTE_RING];
+    _Alignas(64) atomic_long head;  // 消费者已取走的数量
+    _Alignas(64) atomic_long tail;  // 生产者已放入的数量
+} rings[MAX_THREADS];
+
+static long run_remote(int id) {
+    struct ring *out = &rings[(id + 1) % nr_threads];
+    struct ring *in = &rings[id];
+    unsigned int seed = 777 + id;
+    long sent = 0, received = 0;
+
+    while (sent < REMOTE_ITERS || received < REMOTE_ITERS) {
+        int progress = 0;
+        long tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+        if (sent < REMOTE_ITERS &&
+            tail - atomic_load_explicit(&out->head, memory_order_acquire) < REMOTE_RING) {
+            void *ptr = malloc(16 + simple_rand(&seed) % 496);
+            touch(ptr, (int)sent);
+            out->slots[tail & (REMOTE_RING - 1)] = ptr;
+            atomic_store_explicit(&out->tail, tail + 1, memory_order_release);
+            sent++;
+            progress = 1;
+        }
+        long head = atomic_load_explicit(&in->head, memory_order_relaxed);
+        if (head < atomic_load_explicit(&in->tail, memory_order_acquire)) {
+            free(in->slots[head & (REMOTE_RING - 1)]);
+            atomic_store_explicit(&in->head, head + 1, memory_order_release);
+            received++;
+            progress = 1;
+        }
+        if (!progress) {
+            sched_yield();
+        }
+    }
+    return 2L * REMOTE_ITERS;
+}
+
+static const struct scenario {
+    const char *name;
+    long (*run)(int id);
+} scenarios[] = {
+    {"sequential", run_sequential},
+    {"batch", run_batch},
+    {"random", run_random},
+    {"fragmentation", run_fragmentation},
+    {"remote", run_remote},
+};
+
+static const struct scenario *scenario;
+static atomic_long total_ops;
+
+static void *worker(void *arg) {
+    int id = (int)(long)arg;
+    pthread_barrier_wait(&start_barrier);
+    atomic_fetch_add(&total_ops, scenario->run(id));
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int nr = sizeof(scenarios) / sizeof(scenarios[0]);
+    if (argc == 3) {
+        for (int i = 0; i < nr; i++) {
+            if (strcmp(argv[1], scenarios[i].name) == 0) {
+                scenario = &scenarios[i];
+            }
+        }
+        nr_threads = atoi(argv[2]);
+    }
+    if (!scenario || nr_threads < 1 || nr_threads > MAX_THREADS) {
+        fprintf(stderr, "usage: %s <scenario> <threads 1-%d>\nscenarios:",
+                argv[0], MAX_THREADS);
+        for (int i = 0; i < nr; i++) {
+            fprintf(stderr, " %s", scenarios[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    // 计时从所有线程一起出发开始，到最后一个线程结束为止
+    pthread_t threads[MAX_THREADS];
+    pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+    for (int i = 0; i < nr_threads; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+    }
+    pthread_barrier_wait(&start_barrier);
+    double start = now();
+    for (int i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = now() - start;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    long ops = atomic_load(&total_ops);
+    printf("%s,%d,%ld,%.6f,%.3f,%ld\n", scenario->name, nr_threads, ops, seconds,
+           ops / seconds / 1e6, ru.ru_maxrss);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+# 分配器矩阵: 每个分配器 × 每个场景 × 每个线程数运行一次 bench_matrix，
+# 结果以 CSV 写到标准输出，每行带上提交号，方便跨提交比较。
+# 用法: sh benchmarks/bench_matrix.sh ./bench_matrix /path/to/libmymalloc.so
+# 环境变量: THREADS（默认 "1 2 4 8"）、SCENARIOS（默认全部）
+
+bench=$1
+mymalloc=$2
+threads=${THREADS:-"1 2 4 8"}
+scenarios=${SCENARIOS:-"sequential batch random fragmentation remote"}
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+# 每行一个分配器: 名字、LD_PRELOAD 的库（- 表示不预加载）、额外的环境变量
+variants() {
+    echo "glibc - "
+    echo "mymalloc $mymalloc "
+    echo "mymalloc-nosample $mymalloc MYMALLOC_SAMPLE=0"
+    echo "mymalloc-canary $mymalloc MYMALLOC_DEBUG=canary"
+    # 本机装了的其他分配器
+    for lib in libjemalloc.so.2 libtcmalloc_minimal.so.4 libtcmalloc.so.4 \
+               libmimalloc.so.2 libmimalloc.so; do
+        path=$(ldconfig -p 2>/dev/null | awk -v lib="$lib" '$1 == lib { print $NF; exit }')
+        if [ -n "$path" ]; then
+            echo "${lib%%.so*} $path "
+        fi
+    done | sed 's/^lib//' | awk '!seen[$1]++'
+}
+
+echo "commit,allocator,scenario,threads,ops,seconds,mops,peak_rss_kb"
+variants | while read -r name lib env; do
+    preload=
+    [ "$lib" != - ] && preload="LD_PRELOAD=$lib"
+    for s in $scenarios; do
+        for t in $threads; do
+            row=$(env $preload $env "$bench" "$s" "$t") || continue
+            echo "$commit,$name,$row"
+        done
+    done
+done
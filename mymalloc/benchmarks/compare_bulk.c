@@ -0,0 +1,69 @@
+// 批量分配性能对比工具
+// 比较 mymalloc_bulk/myfree_bulk 与逐个调用 mymalloc/myfree 的循环
+// 编译: gcc -O2 -I. benchmarks/compare_bulk.c mymalloc.c start.c -lpthread -o compare_bulk
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "mymalloc.h"
+
+#define BATCH  256      // 每批对象数
+#define ROUNDS 4000     // 每种大小的批数
+
+static void *ptrs[BATCH];
+
+static long long get_time_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// 逐个分配、逐个释放
+static double run_loop(size_t size) {
+    long long start = get_time_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < BATCH; i++) {
+            ptrs[i] = mymalloc(size);
+            *(char *)ptrs[i] = 1;  // 碰一下内存，两边一样
+        }
+        for (int i = 0; i < BATCH; i++) {
+            myfree(ptrs[i]);
+        }
+    }
+    long long elapsed = get_time_us() - start;
+    return (double)ROUNDS * BATCH / elapsed;  // M objs/s
+}
+
+// 一次调用分配整批、一次调用释放整批
+static double run_bulk(size_t size) {
+    long long start = get_time_us();
+    for (int r = 0; r < ROUNDS; r++) {
+        if (mymalloc_bulk(size, BATCH, ptrs) != BATCH) {
+            printf("mymalloc_bulk(%zu) ran out of memory\n", size);
+            exit(1);
+        }
+        for (int i = 0; i < BATCH; i++) {
+            *(char *)ptrs[i] = 1;
+        }
+        myfree_bulk(ptrs, BATCH);
+    }
+    long long elapsed = get_time_us() - start;
+    return (double)ROUNDS * BATCH / elapsed;
+}
+
+int main() {
+    printf("=== 批量分配性能对比 (每批 %d 个, %d 批) ===\n", BATCH, ROUNDS);
+    printf("%-8s %16s %16s %8s\n", "size", "loop (M/s)", "bulk (M/s)", "speedup");
+    // 小对象走 slab，中等大小走堆块，最后一档是大块映射
+    size_t sizes[] = {16, 64, 256, 1024, 2048, 8192, 32768, 256 * 1024};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        // 先各跑一轮热身，让两边都从已映射的内存开始
+        run_loop(sizes[i]);
+        double l = run_loop(sizes[i]);
+        run_bulk(sizes[i]);
+        double b = run_bulk(sizes[i]);
+        printf("%-8zu %16.2f %16.2f %7.2fx\n", sizes[i], l, b, b / l);
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+// 自旋锁性能对比工具
+// 比较 mymalloc.h 中带退避/futex 的 spin_lock 和原来的纯 CAS 自旋锁
+// 编译: gcc -O2 -I. benchmarks/compare_lock.c -lpthread -o compare_lock
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "mymalloc.h"
+
+#define OPS_PER_THREAD 200000
+#define CS_WORK        32  // 临界区内的工作量（模拟一次 find_address）
+
+// 原来的锁：失败后立即重试 CAS，不退避也不睡眠
+static inline void old_lock(spinlock_t *lock) {
+    int expected;
+    do {
+        expected = UNLOCKED;
+    } while (!atomic_compare_exchange_strong(&lock->status, &expected, LOCKED));
+}
+
+static inline void old_unlock(spinlock_t *lock) {
+    atomic_store_explicit(&lock->status, UNLOCKED, memory_order_release);
+}
+
+static spinlock_t lock = {UNLOCKED};
+static volatile long shared[CS_WORK];
+static int use_new;
+
+static long long get_time_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        if (use_new) {
+            spin_lock(&lock);
+        } else {
+            old_lock(&lock);
+        }
+        for (int j = 0; j < CS_WORK; j++) {
+            shared[j]++;
+        }
+        if (use_new) {
+            spin_unlock(&lock);
+        } else {
+            old_unlock(&lock);
+        }
+    }
+    return NULL;
+}
+
+static double run(int nthreads, int new_lock) {
+    pthread_t tids[nthreads];
+    use_new = new_lock;
+    long long start = get_time_us();
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&tids[i], NULL, worker, NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    long long elapsed = get_time_us() - start;
+    return (double)nthreads * OPS_PER_THREAD / elapsed;  // M ops/s
+}
+
+int main() {
+    printf("=== 自旋锁性能对比 (临界区 %d 次写) ===\n", CS_WORK);
+    printf("%-8s %14s %14s\n", "threads", "old (Mops/s)", "new (Mops/s)");
+    int threads[] = {1, 2, 4, 8};
+    for (int i = 0; i < 4; i++) {
+        double o = run(threads[i], 0);
+        double n = run(threads[i], 1);
+        printf("%-8d %14.2f %14.2f\n", threads[i], o, n);
+    }
+    if (shared[0] != (long)2 * OPS_PER_THREAD * (1 + 2 + 4 + 8)) {
+        printf("mutual exclusion broken: %ld\n", shared[0]);
+        return 1;
+    }
+    return 0;
+}
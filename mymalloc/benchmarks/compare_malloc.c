@@ -135,8 +135,8 @@ void benchmark_random_sizes(int iterations) {
 }
 
 // 基准测试4: 碎片化测试
-void benchmark_fragmentation() {
-    printf("\nFragmentation Test:\n");
+void benchmark_fragmentation(size_t small_size, size_t large_size) {
+    printf("\nFragmentation Test (%zu/%zu bytes):\n", small_size, large_size);
     
     const int pairs = 500;
     void **small_ptrs = malloc(pairs * sizeof(void*));
@@ -151,8 +151,8 @@ void benchmark_fragmentation() {
     
     // 交替分配大小对象
     for (int i = 0; i < pairs; i++) {
-        small_ptrs[i] = test_malloc(32);
-        large_ptrs[i] = test_malloc(256);
+        small_ptrs[i] = test_malloc(small_size);
+        large_ptrs[i] = test_malloc(large_size);
     }
     
     // 释放小对象（创建碎片）
@@ -166,7 +166,7 @@ void benchmark_fragmentation() {
     // 尝试分配中等对象
     int successful = 0;
     for (int i = 0; i < pairs / 2; i++) {
-        void *ptr = test_malloc(64);
+        void *ptr = test_malloc(small_size * 2);
         if (ptr) {
             successful++;
             test_free(ptr);
@@ -206,12 +206,16 @@ int main() {
     benchmark_sequential(10000);
     benchmark_batch(1000);
     benchmark_random_sizes(5000);
-    benchmark_fragmentation();
+    benchmark_fragmentation(32, 256);
+    benchmark_fragmentation(2048, 8192);
     
     printf("\n========================================\n");
     printf("Benchmark completed.\n");
     
     #ifdef MYMALLOC_TEST
+    printf("\n");
+    mymalloc_stats_print();
+
     printf("\nTo compare with system malloc:\n");
     printf("  gcc -O2 -o compare_system compare_malloc.c\n");
     printf("  ./compare_system\n");
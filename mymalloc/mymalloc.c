@@ -1,28 +1,340 @@
+#ifndef FREESTANDING
+#define _GNU_SOURCE  // sched_getcpu(), dladdr()
+#endif
 #include <mymalloc.h>
 #include <stdio.h>
 #include <stdint.h>
+#ifndef FREESTANDING
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+#include <unwind.h>
+#include <fcntl.h>
+#endif
 
 // Function declarations
-freeBlock *find_previous_block(freeBlock *block);
-freeBlock *find_next_block(freeBlock *block);
-int can_merge(freeBlock *block1, freeBlock *block2);
 int is_valid_block(freeBlock *block);
-int is_block_in_free_list(freeBlock *block);
-void merge_blocks(freeBlock *block1, freeBlock *block2);
-void insert_into_free_list(freeBlock *block);
+freeBlock *merge_blocks(freeBlock *block1, freeBlock *block2);
+void insert_into_free_list(heap *h, freeBlock *block);
+void remove_from_free_list(heap *h, freeBlock *block);
+void release_block(heap *h, freeBlock *block);
+static freeBlock *grow_heap(heap *h, size_t size);
 
-spinlock_t big_lock = {ATOMIC_VAR_INIT(0)};
 static spinlock_t init_lock = {ATOMIC_VAR_INIT(0)};
 static atomic_int initialized = ATOMIC_VAR_INIT(0);
-size_t heap_size = 4096*10;
-static freeBlock *free_list_head = NULL;
-static void *heap_start = NULL;
+
+// Hosted builds keep one heap per CPU (modulo NR_HEAPS): a thread carves
+// blocks from the heap of the CPU it runs on, and only steals from the
+// others once its own is out of space and cannot grow.
+#ifndef FREESTANDING
+#define NR_HEAPS 16
+#else
+#define NR_HEAPS 1
+#endif
+static heap heaps[NR_HEAPS];
+
+// Heaps grow one chunk at a time until together they have mapped
+// heap_limit bytes (large mappings included).
+#define PAGE_SIZE  4096
+#define CHUNK_SIZE (1 << 20)
+size_t heap_limit = SIZE_MAX;
+static _Atomic size_t heap_mapped = 0;
 atomic_long malloc_count = ATOMIC_VAR_INIT(0);
 
-freeBlock *find_free_block(size_t size) {
-    freeBlock *current = free_list_head;
+// Free heap spans left untouched for purge_interval_ms have their pages
+// handed back to the kernel (the address range stays mapped). The check
+// runs as blocks are freed; 0 turns it off, leaving only mymalloc_purge().
+long purge_interval_ms = 1000;
+
+#ifndef FREESTANDING
+// MYMALLOC_DEBUG_* flags; see debug_alloc().
+#ifndef MYMALLOC_DEBUG
+#define MYMALLOC_DEBUG 0
+#endif
+int mymalloc_debug = MYMALLOC_DEBUG;
+
+// Freed blocks waiting to be reused, oldest first (MYMALLOC_DEBUG_QUARANTINE)
+#define QUARANTINE_SLOTS 4096
+#define QUARANTINE_BYTES (4 << 20)
+static struct {
+    spinlock_t lock;
+    void *ring[QUARANTINE_SLOTS];
+    int head, count;
+    size_t bytes;
+} quarantine;
+
+// Sampled allocations: about one per mymalloc_sample_interval bytes
+// allocated (0 turns sampling off); see take_sample().
+#ifndef MYMALLOC_SAMPLE_INTERVAL
+#define MYMALLOC_SAMPLE_INTERVAL (512 * 1024)
+#endif
+size_t mymalloc_sample_interval = MYMALLOC_SAMPLE_INTERVAL;
+
+#define PROFILE_DEPTH   32    // frames kept per sample
+#define PROFILE_SLOTS   4096  // live samples kept at most
+#define PROFILE_BUCKETS 4096
+
+typedef struct profile_sample {
+    void *block;  // as returned by alloc_block() and friends
+    size_t size;
+    size_t interval;  // mymalloc_sample_interval when it was taken
+    struct profile_sample *next;  // in its bucket, or in the pool
+    int depth;
+    void *stack[PROFILE_DEPTH];
+} profile_sample;
+
+// Live samples, hashed by block address. The slab or chunk a sampled block
+// lives in counts it, so frees elsewhere never look at the table.
+static struct {
+    spinlock_t lock;
+    profile_sample *buckets[PROFILE_BUCKETS];
+    profile_sample *pool;  // entries of freed samples
+    int used;  // entries handed out from `entries`
+    profile_sample entries[PROFILE_SLOTS];
+} profile;
+
+static void profile_forget(void *block);
+static void profile_exit(void);
+#endif
+static atomic_long debug_errors = ATOMIC_VAR_INIT(0);
+
+// Boundary tags: a heap block's header and footer words hold its size
+// plus the TAG_* bits, so both neighbours are reachable in O(1). A slab
+// object's header word holds its slab address plus TAG_SLAB instead;
+// TAG_IN_USE marks live blocks and objects in either case.
+#define TAG_SLAB   1
+#define TAG_IN_USE 2
+#define TAG_LARGE  4
+#define TAG_MASK   ((size_t)7)
+#define OBJ_HEADER(ptr) (((size_t *)(ptr))[-1])
+
+// Every pointer handed out is aligned to ALIGNMENT, alignof(max_align_t) on
+// x86-64, as a malloc() replacement must be. Heap blocks therefore start
+// one header word before an ALIGNMENT boundary and span a multiple of it.
+#define ALIGNMENT      16
+#define ALIGN_UP(n)    (((n) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+#define BLOCK_OVERHEAD (2 * sizeof(size_t))              // header + footer
+#define MIN_BLOCK      ALIGN_UP(sizeof(freeBlock) + sizeof(size_t))
+#define CHUNK_HEADER   ALIGN_UP(sizeof(chunk))           // up to the prologue
+#define CHUNK_OVERHEAD (CHUNK_HEADER + 2 * sizeof(size_t)) // + prologue, epilogue
+
+static inline size_t block_size(freeBlock *block) {
+    return block->size & ~TAG_MASK;
+}
+
+static inline void set_block(freeBlock *block, size_t size, size_t tags) {
+    block->size = size | tags;
+    ((size_t *)((char *)block + size))[-1] = size | tags;
+}
+
+// Bytes of heap block needed to hold a size-byte payload
+static inline size_t block_need(size_t size) {
+    size = ALIGN_UP(size) + BLOCK_OVERHEAD;
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+static inline freeBlock *chunk_first_block(chunk *c) {
+    return (freeBlock *)((char *)c + CHUNK_HEADER + sizeof(size_t));
+}
+
+// Requests of at least large_threshold bytes bypass the heap: each gets a
+// mapping of its own (a chunk header, then the tag word, then the payload)
+// that myfree() hands straight back to the page provider.
+#define LARGE_HEADER ALIGN_UP(sizeof(chunk) + sizeof(size_t))
+size_t large_threshold = 128 * 1024;
+
+// Small size classes (payload bytes) served from slabs.
+static const size_t class_size[] = {
+    8, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024,
+};
+#define NR_CLASSES ((int)(sizeof(class_size) / sizeof(class_size[0])))
+_Static_assert(NR_CLASSES == MYMALLOC_NR_CLASSES, "class table size");
+#define SMALL_MAX  1024
+
+// size_to_class[(size + 7) / 8] is the smallest class that fits size.
+static unsigned char size_to_class[SMALL_MAX / 8 + 1];
+
+// A slab is one page, or just enough for SLAB_MAX_OBJS objects of a tiny
+// class, so a class that is barely used does not pin a whole page.
+#define SLAB_SIZE     4096
+#define SLAB_MAX_OBJS 32
+#define SLAB_MAGIC    0x51ab51abu
+// Slots are a multiple of ALIGNMENT and start after the slab header, one
+// header word before a boundary, so every object is aligned.
+#define SLAB_HEADER   (ALIGN_UP(sizeof(slab) + sizeof(size_t)) - sizeof(size_t))
+
+// Per-thread counters behind mymalloc_stats(). Only the owning thread
+// writes them, with a plain load and store, so the hot path stays free of
+// read-modify-write atomics; readers may see slightly stale values.
+struct thread_stats {
+    atomic_long nr_malloc;
+    atomic_long nr_free;
+    atomic_long bytes_in_use;
+    atomic_long lock_spins;
+    atomic_long heap_steals;
+    atomic_long class_allocs[NR_CLASSES];
+    atomic_long class_frees[NR_CLASSES];
+    struct thread_stats *next;
+};
+
+// Live threads' counters, plus the totals of threads that have exited
+static spinlock_t stats_lock = {ATOMIC_VAR_INIT(0)};
+static struct thread_stats *stats_list = NULL;
+static struct thread_stats retired_stats;
+
+#ifndef FREESTANDING
+// Per-thread caches: small objects are handed out and taken back without
+// touching a heap lock or any atomic. Refills and drains move whole
+// batches under a single lock acquisition.
+#define TCACHE_BATCH       32           // max objects moved per refill/drain
+#define TCACHE_BATCH_BYTES 4096         // ...and at most this many bytes
+#define TCACHE_MAX_BYTES   (16 * 1024)  // per-thread cap on cached bytes
+#define TCACHE_COUNT_FLUSH 64           // publish malloc_count every N calls
+
+struct tcache {
+    void *bins[NR_CLASSES];
+    int count[NR_CLASSES];
+    size_t bytes;
+    long malloc_count;
+    int registered;  // 0 before the first call, 1 live, -1 once exited
+    remote_free *remote;  // where other threads return our objects
+    long sample_left;     // bytes to allocate before the next sample
+    uint64_t sample_rng;  // 0 until the first draw
+    struct thread_stats stats;
+};
+
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+
+// remote_free lists of exited threads, waiting for a new owner
+#define REMOTE_CLOSED ((void *)1)
+static remote_free *remote_pool = NULL;
+
+// Central free lists: each batch a thread cache drains is pushed whole onto
+// a lock-free stack per class, and refills pop a batch from there before
+// taking a heap lock. A batch is chained through its objects' first words;
+// the stack links batches through the second word of their first object,
+// so the 8-byte class goes straight back to its slabs. Beyond
+// CENTRAL_MAX_BATCHES per class, batches go back to their slabs too.
+#define CENTRAL_MAX_BATCHES 16
+#define CENTRAL_LINK        sizeof(void *)
+static tagged_stack central[NR_CLASSES];
+
+static void tcache_flush(void);
+static void tcache_reclaim(void);
+static void tcache_exit(void *arg);
+static void central_release(void);
+
+// Calls made after the thread's cache has exited count straight into
+// retired_stats, which every exiting thread adds to: atomically there.
+#define STATS (tcache.registered >= 0 ? &tcache.stats : &retired_stats)
+
+static inline void stat_add(atomic_long *counter, long n) {
+    if (tcache.registered < 0) {
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+        return;
+    }
+    atomic_store_explicit(counter,
+        atomic_load_explicit(counter, memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+#else
+// No thread-local storage here: one shared set of counters.
+static struct thread_stats global_stats;
+#define STATS (&global_stats)
+
+static inline void stat_add(atomic_long *counter, long n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+#endif
+
+static inline void lock_heap(heap *h) {
+    int spins = spin_lock(&h->lock);
+    if (spins) {
+        stat_add(&STATS->lock_spins, spins);
+    }
+}
+
+static inline void unlock_heap(heap *h) {
+    spin_unlock(&h->lock);
+}
+
+// The heap of the CPU we are running on. If the CPU is unknown, threads
+// are spread by the address of their thread cache instead.
+static heap *my_heap(void) {
+#ifndef FREESTANDING
+    int cpu = sched_getcpu();
+    if (cpu < 0) {
+        cpu = (int)(((uint64_t)(uintptr_t)&tcache * 0x9e3779b97f4a7c15ull) >> 40);
+    }
+    return &heaps[cpu % NR_HEAPS];
+#else
+    return &heaps[0];
+#endif
+}
+
+// Account for `bytes` more mapped memory, unless that would pass heap_limit.
+static int reserve_mapped(size_t bytes) {
+    size_t cur = atomic_load_explicit(&heap_mapped, memory_order_relaxed);
+    do {
+        if (cur > heap_limit || bytes > heap_limit - cur) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&heap_mapped, &cur, cur + bytes));
+    return 1;
+}
+
+static inline void unreserve_mapped(size_t bytes) {
+    atomic_fetch_sub(&heap_mapped, bytes);
+}
+
+// Chunks, arenas and page map nodes all come from here: mmap in hosted
+// builds, the runtime's page provider in freestanding ones.
+#ifdef FREESTANDING
+static mymalloc_page_provider page_provider;
+
+void mymalloc_set_page_provider(const mymalloc_page_provider *provider) {
+    page_provider = *provider;
+}
+
+static void *map_pages(size_t length) {
+    return page_provider.alloc ? page_provider.alloc(length) : NULL;
+}
+
+// Whether unmap_pages() really gives anything back.
+static inline int can_unmap(void) {
+    return page_provider.free != NULL;
+}
+
+static void unmap_pages(void *addr, size_t length) {
+    if (page_provider.free) {
+        page_provider.free(addr, length);
+    }
+}
+#else
+static inline void *map_pages(size_t length) {
+    return vmalloc(NULL, length);
+}
+
+static inline int can_unmap(void) {
+    return 1;
+}
+
+static inline void unmap_pages(void *addr, size_t length) {
+    vmfree(addr, length);
+}
+#endif
+
+freeBlock *find_free_block(heap *h, size_t size) {
+    size_t need = block_need(size);
+    freeBlock *current = h->free_list;
     while (current) {
-        if (current->size >= size + sizeof(freeBlock)) {
+        if (block_size(current) >= need) {
             break;
         }
         current = current->next;
@@ -30,54 +342,36 @@ freeBlock *find_free_block(size_t size) {
     return current;
 }
 
-void split_block(freeBlock *block, size_t size) {
+void split_block(heap *h, freeBlock *block, size_t size) {
+    size_t need = block_need(size);
+    size_t total = block_size(block);
+    remove_from_free_list(h, block);
+
     // If the block is larger than needed, split it
-    if (block->size > size + 2 * sizeof(freeBlock)) {
+    if (total - need >= MIN_BLOCK) {
         // Create a new free block for the remaining space
-        freeBlock *new_block = (freeBlock *)((char *)block + sizeof(freeBlock) + size);
-        new_block->size = block->size - size - sizeof(freeBlock);
-        new_block->prev = block->prev;
-        new_block->next = block->next;
-        
-        // Replace the original block with the new block in the free list
-        if (block->prev) {
-            block->prev->next = new_block;
-        } else {
-            free_list_head = new_block;
-        }
-        if (block->next) {
-            block->next->prev = new_block;
-        }
-        
-        // Update the original block (now allocated)
-        block->size = size + sizeof(freeBlock);
-        block->prev = NULL;
-        block->next = NULL;
-    } else {
-        // Remove the entire block from the free list (no splitting)
-        if (block->prev) {
-            block->prev->next = block->next;
-        } else {
-            free_list_head = block->next;
-        }
-        if (block->next) {
-            block->next->prev = block->prev;
-        }
-        
-        // Clear the block's pointers (now allocated)
-        block->prev = NULL;
-        block->next = NULL;
+        freeBlock *new_block = (freeBlock *)((char *)block + need);
+        set_block(new_block, total - need, 0);
+        new_block->freed_at = block->freed_at;
+        insert_into_free_list(h, new_block);
+        total = need;
     }
+    set_block(block, total, TAG_IN_USE);
 }
 
-void *find_address(size_t size) {
-    freeBlock *block = find_free_block(size);
+// Carve a block for a size-byte payload out of h, growing it if needed.
+// Caller holds h->lock.
+void *find_address(heap *h, size_t size) {
+    freeBlock *block = find_free_block(h, size);
+    if (!block) {
+        block = grow_heap(h, size);
+    }
     if (block) {
-        split_block(block, size);
-        void *result = (void *)((char *)block + sizeof(freeBlock));
-        // Ensure 8-byte alignment of returned address
+        split_block(h, block, size);
+        void *result = (void *)((char *)block + sizeof(size_t));
+        // Ensure ALIGNMENT of returned address
         uintptr_t addr = (uintptr_t)result;
-        if (addr & 7) {
+        if (addr & (ALIGNMENT - 1)) {
             // This should not happen if our heap and structures are properly aligned
             return NULL;
         }
@@ -86,203 +380,2287 @@ void *find_address(size_t size) {
     return NULL;
 }
 
-void *mymalloc(size_t size) {
-    // Count all malloc attempts (including size 0)
-    atomic_fetch_add(&malloc_count, 1);
-    
-    // Ensure 8-byte alignment
-    if (size == 0) return NULL;
-    
-    // Check for overflow and unreasonably large sizes
-    if (size > heap_size || size > SIZE_MAX - sizeof(freeBlock) - 8) {
+// Page map: page number -> owning chunk, so any pointer can be checked
+// without taking a lock. Leaves are mapped on first use and never freed.
+#ifndef FREESTANDING
+#define PM_LEAF_BITS 20
+#define PM_ROOT_BITS (47 - 12 - PM_LEAF_BITS)
+
+static _Atomic(chunk *) *_Atomic pagemap[1 << PM_ROOT_BITS];
+
+static chunk *find_chunk(void *ptr) {
+    uintptr_t page = (uintptr_t)ptr / PAGE_SIZE;
+    if (page >> (PM_ROOT_BITS + PM_LEAF_BITS)) {
         return NULL;
     }
-    
-    size = (size + 7) & ~7;  // Round up to 8-byte boundary
-    
-    // Thread-safe initialization using double-checked locking
-    if (atomic_load(&initialized) == 0) {
-        spin_lock(&init_lock);
-        if (atomic_load(&initialized) == 0) {
-#ifndef FREESTANDING
-            heap_start = vmalloc(NULL, heap_size);
-            if (heap_start == NULL) {
-                spin_unlock(&init_lock);
-                return NULL;
+    _Atomic(chunk *) *leaf = atomic_load_explicit(&pagemap[page >> PM_LEAF_BITS],
+                                                  memory_order_acquire);
+    if (!leaf) {
+        return NULL;
+    }
+    return atomic_load_explicit(&leaf[page & ((1 << PM_LEAF_BITS) - 1)],
+                                memory_order_relaxed);
+}
+
+// Point every page of [start, start + length) at c. Callers own the pages
+// in question; a missing leaf is installed with a CAS, so heaps that race
+// to map one simply keep the winner's.
+static int pagemap_set(void *start, size_t length, chunk *c) {
+    uintptr_t first = (uintptr_t)start / PAGE_SIZE;
+    uintptr_t last = ((uintptr_t)start + length - 1) / PAGE_SIZE;
+    for (uintptr_t page = first; page <= last; page++) {
+        _Atomic(chunk *) *leaf = atomic_load_explicit(
+            &pagemap[page >> PM_LEAF_BITS], memory_order_acquire);
+        if (!leaf) {
+            _Atomic(chunk *) *fresh = map_pages(sizeof(*leaf) << PM_LEAF_BITS);
+            if (!fresh) {
+                return 0;
+            }
+            if (atomic_compare_exchange_strong(&pagemap[page >> PM_LEAF_BITS],
+                                               &leaf, fresh)) {
+                leaf = fresh;
+            } else {
+                unmap_pages(fresh, sizeof(*leaf) << PM_LEAF_BITS);
             }
-            // printf("initial address=%p\n", heap_start);
-            free_list_head = (freeBlock *)heap_start;
-            free_list_head->size = heap_size;
-            free_list_head->prev = NULL;
-            free_list_head->next = NULL;
-#else
-            // In freestanding mode, use static memory
-            static char static_heap[4096 * 10] __attribute__((aligned(8)));
-            heap_start = static_heap;
-            free_list_head = (freeBlock *)static_heap;
-            free_list_head->size = sizeof(static_heap);
-            free_list_head->prev = NULL;
-            free_list_head->next = NULL;
-#endif
-            atomic_store(&initialized, 1);
         }
-        spin_unlock(&init_lock);
+        atomic_store_explicit(&leaf[page & ((1 << PM_LEAF_BITS) - 1)], c,
+                              memory_order_relaxed);
+    }
+    return 1;
+}
+#else
+// An 8 MiB leaf is more than a small runtime can spare, so freestanding
+// builds put a middle level in and keep every node at 32 KiB.
+#define PM_NODE_BITS 12
+#define PM_NODE_SIZE (sizeof(void *) << PM_NODE_BITS)
+#define PM_ROOT_BITS (47 - 12 - 2 * PM_NODE_BITS)
+#define PM_INDEX(page, level) \
+    (((page) >> ((level) * PM_NODE_BITS)) & ((1 << PM_NODE_BITS) - 1))
+
+static _Atomic(void *) pagemap[1 << PM_ROOT_BITS];
+
+static chunk *find_chunk(void *ptr) {
+    uintptr_t page = (uintptr_t)ptr / PAGE_SIZE;
+    if (page >> (PM_ROOT_BITS + 2 * PM_NODE_BITS)) {
+        return NULL;
+    }
+    _Atomic(void *) *mid = atomic_load_explicit(&pagemap[page >> (2 * PM_NODE_BITS)],
+                                                memory_order_acquire);
+    if (!mid) {
+        return NULL;
+    }
+    _Atomic(chunk *) *leaf = atomic_load_explicit(&mid[PM_INDEX(page, 1)],
+                                                  memory_order_acquire);
+    if (!leaf) {
+        return NULL;
     }
+    return atomic_load_explicit(&leaf[PM_INDEX(page, 0)], memory_order_relaxed);
+}
 
-    spin_lock(&big_lock);
-    void *addr = find_address(size);
-    // printf("malloc_count=%ld\n", atomic_load(&malloc_count));
-    spin_unlock(&big_lock);
+// The node behind *slot, installed with a CAS if there is none yet.
+static void *pagemap_node(_Atomic(void *) *slot) {
+    void *node = atomic_load_explicit(slot, memory_order_acquire);
+    if (!node) {
+        void *fresh = map_pages(PM_NODE_SIZE);
+        if (!fresh) {
+            return NULL;
+        }
+        if (atomic_compare_exchange_strong(slot, &node, fresh)) {
+            node = fresh;
+        } else {
+            unmap_pages(fresh, PM_NODE_SIZE);
+        }
+    }
+    return node;
+}
 
-    return addr;
+static int pagemap_set(void *start, size_t length, chunk *c) {
+    uintptr_t first = (uintptr_t)start / PAGE_SIZE;
+    uintptr_t last = ((uintptr_t)start + length - 1) / PAGE_SIZE;
+    for (uintptr_t page = first; page <= last; page++) {
+        _Atomic(void *) *mid = pagemap_node(&pagemap[page >> (2 * PM_NODE_BITS)]);
+        _Atomic(chunk *) *leaf = mid ? pagemap_node(&mid[PM_INDEX(page, 1)]) : NULL;
+        if (!leaf) {
+            return 0;
+        }
+        atomic_store_explicit(&leaf[PM_INDEX(page, 0)], c, memory_order_relaxed);
+    }
+    return 1;
 }
+#endif
 
-void myfree(void *ptr) {
-    if(ptr == NULL) {
-        return;
+// Link a freshly mapped chunk into h. The caller has already accounted
+// for it in heap_mapped.
+static void add_chunk(heap *h, chunk *c, size_t size) {
+    c->size = size;
+    c->heap = h;
+    c->keep_mapped = 0;
+    atomic_store_explicit(&c->sampled, 0, memory_order_relaxed);
+    c->prev = NULL;
+    c->next = h->chunks;
+    if (h->chunks) {
+        h->chunks->prev = c;
     }
-    freeBlock *block = (freeBlock *)((char *)ptr - sizeof(freeBlock));
-    if(!is_valid_block(block)) {
-        return;
+    h->chunks = c;
+    h->nr_chunks++;
+
+    // In-use prologue and epilogue words fence the chunk's blocks
+    size_t *prologue = (size_t *)((char *)c + CHUNK_HEADER);
+    size_t *epilogue = (size_t *)((char *)c + size) - 1;
+    *prologue = TAG_IN_USE;
+    *epilogue = TAG_IN_USE;
+
+    // Freshly mapped pages are not resident yet: nothing to purge
+    freeBlock *block = chunk_first_block(c);
+    set_block(block, size - CHUNK_OVERHEAD, 0);
+    block->freed_at = 0;
+    insert_into_free_list(h, block);
+}
+
+// Map a new chunk with room for a size-byte block. Caller holds h->lock.
+static freeBlock *grow_heap(heap *h, size_t size) {
+    size_t need = (CHUNK_OVERHEAD + block_need(size) + PAGE_SIZE - 1) &
+                  ~(size_t)(PAGE_SIZE - 1);
+    size_t mapped = atomic_load_explicit(&heap_mapped, memory_order_relaxed);
+    size_t room = heap_limit > mapped ? heap_limit - mapped : 0;
+    size_t bytes = need < CHUNK_SIZE ? CHUNK_SIZE : need;
+    if (bytes > room) bytes = room & ~(size_t)(PAGE_SIZE - 1);
+    if (bytes < need || !reserve_mapped(bytes)) {
+        return NULL;
     }
 
-    spin_lock(&big_lock);
+    chunk *c = map_pages(bytes);
+    if (!c) {
+        unreserve_mapped(bytes);
+        return NULL;
+    }
+    if (!pagemap_set(c, bytes, c)) {
+        unmap_pages(c, bytes);
+        unreserve_mapped(bytes);
+        return NULL;
+    }
+    add_chunk(h, c, bytes);
+    return chunk_first_block(c);
+}
 
-    // Check for double free - if block is already in free list, just return
-    if (is_block_in_free_list(block)) {
-        spin_unlock(&big_lock);
-        return; // Silent return on double free
+// Unmap a chunk whose only block is free, keeping at least one chunk per
+// heap around so a program that frees everything does not thrash. Chunks
+// that have held slabs stay mapped (see new_slab()); purging still hands
+// their pages back. A page provider that takes nothing back
+// keeps every chunk in its heap. Caller holds h->lock.
+static void try_release_chunk(heap *h, freeBlock *block) {
+    chunk *c = find_chunk(block);
+    if (block != chunk_first_block(c) || block_size(block) != c->size - CHUNK_OVERHEAD ||
+        h->nr_chunks == 1 || c->keep_mapped || !can_unmap()) {
+        return;
     }
+    remove_from_free_list(h, block);
 
-    // First, add the block to the free list
-    insert_into_free_list(block);
-    
-    // Then try to coalesce with adjacent blocks
-    freeBlock *prev = find_previous_block(block);
-    if (prev && can_merge(prev, block)) {
-        merge_blocks(prev, block);
-        block = prev;  // Update block to point to the merged block
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        h->chunks = c->next;
     }
-    
-    freeBlock *next = find_next_block(block);
-    if (next && can_merge(block, next)) {
-        merge_blocks(block, next);
+    if (c->next) {
+        c->next->prev = c->prev;
     }
+    h->nr_chunks--;
+    size_t bytes = c->size;
+    pagemap_set(c, bytes, NULL);
+    unmap_pages(c, bytes);
+    unreserve_mapped(bytes);
+}
 
-    spin_unlock(&big_lock);
+#ifndef FREESTANDING
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;  // never 0
 }
 
-freeBlock *find_previous_block(freeBlock *block) {
-    freeBlock *current = free_list_head;
-    freeBlock *result = NULL;
-    while (current) {
-        if((char *)(current) + current->size <= (char *)(block)) {
-            result = current;
+// Return the whole pages inside free blocks freed at or before older_than.
+// The block's own header and footer stay resident. Caller holds h->lock.
+static size_t purge_free_spans(heap *h, long older_than) {
+    size_t released = 0;
+    for (freeBlock *b = h->free_list; b; b = b->next) {
+        if (b->freed_at == 0 || b->freed_at > older_than) {
+            continue;
+        }
+        b->freed_at = 0;
+        uintptr_t start = ((uintptr_t)(b + 1) + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)b + block_size(b) - sizeof(size_t)) &
+                        ~(uintptr_t)(PAGE_SIZE - 1);
+        if (end > start) {
+            vmpurge((void *)start, end - start);
+            released += end - start;
         }
-        current = current->next;
     }
-    return result;
+    return released;
 }
+#endif
 
-freeBlock *find_next_block(freeBlock *block) {
-    char *block_end = (char *)block + block->size;
-    freeBlock *current = free_list_head;
-    freeBlock *closest = NULL;
-    
-    while (current) {
-        if ((char *)current >= block_end) {
-            // 如果这是第一个找到的，或者比之前找到的更接近
-            if (!closest || (char *)current < (char *)closest) {
-                closest = current;
-            }
-        }
-        current = current->next;
+size_t mymalloc_purge(void) {
+#ifndef FREESTANDING
+    central_release();
+    size_t released = 0;
+    for (int i = 0; i < NR_HEAPS; i++) {
+        lock_heap(&heaps[i]);
+        released += purge_free_spans(&heaps[i], LONG_MAX);
+        heaps[i].last_purge = now_ms();
+        unlock_heap(&heaps[i]);
     }
-    return closest;
+    return released;
+#else
+    return 0;
+#endif
 }
 
-int can_merge(freeBlock *block, freeBlock *next) {
-    if((char *)(block) + block->size == (char *)(next)) {
-        return 1;
+#ifndef FREESTANDING
+// MYMALLOC_DEBUG=canary,guard,quarantine,abort, or "all" for the first three
+static int debug_flags_from_env(void) {
+    const char *env = getenv("MYMALLOC_DEBUG");
+    if (!env) {
+        return 0;
     }
-    return 0;
+    if (strstr(env, "all")) {
+        return MYMALLOC_DEBUG_CANARY | MYMALLOC_DEBUG_GUARD | MYMALLOC_DEBUG_QUARANTINE |
+               (strstr(env, "abort") ? MYMALLOC_DEBUG_ABORT : 0);
+    }
+    return (strstr(env, "canary") ? MYMALLOC_DEBUG_CANARY : 0) |
+           (strstr(env, "guard") ? MYMALLOC_DEBUG_GUARD : 0) |
+           (strstr(env, "quarantine") ? MYMALLOC_DEBUG_QUARANTINE : 0) |
+           (strstr(env, "abort") ? MYMALLOC_DEBUG_ABORT : 0);
 }
 
-// Check if a block is already in the free list (for double-free detection)
-int is_block_in_free_list(freeBlock *block) {
-    freeBlock *current = free_list_head;
-    while (current) {
-        if (current == block) {
-            return 1; // Found the block in free list
-        }
-        current = current->next;
+// Hold every allocator lock across fork() so the child never inherits one
+// that a vanished thread was holding.
+static void prefork(void) {
+    for (int i = 0; i < NR_HEAPS; i++) {
+        spin_lock(&heaps[i].lock);
     }
-    return 0; // Block not in free list
+    spin_lock(&stats_lock);
+    spin_lock(&quarantine.lock);
+    spin_lock(&profile.lock);
 }
 
-int is_valid_block(freeBlock *block){
-    // Basic validation: check if block pointer is reasonable
-    if (!block) return 0;
-    
-    // Check if heap has been initialized
-    if (!heap_start) return 0;
-    
-    uintptr_t block_addr = (uintptr_t)block;
-    uintptr_t heap_start_addr = (uintptr_t)heap_start;
-    uintptr_t heap_end_addr = heap_start_addr + heap_size;
-    
-    // Check if block is within heap bounds
-    if (block_addr < heap_start_addr || block_addr >= heap_end_addr) return 0;
-    
-    // Check alignment
-    if (block_addr % 8 != 0) return 0;  // Should be 8-byte aligned
-    
-    // Check if block size is reasonable (not zero, not too large)
-    if (block->size == 0 || block->size > heap_size) return 0;
-    
-    // Check if the entire block (including its size) is within heap bounds
-    if (block_addr + block->size > heap_end_addr) return 0;
-    
+static void postfork(void) {
+    spin_unlock(&profile.lock);
+    spin_unlock(&quarantine.lock);
+    spin_unlock(&stats_lock);
+    for (int i = NR_HEAPS - 1; i >= 0; i--) {
+        spin_unlock(&heaps[i].lock);
+    }
+}
+#endif
+
+static int heap_init(void) {
+    // Thread-safe initialization using double-checked locking
+    if (atomic_load(&initialized) == 0) {
+        int first = 0;
+        spin_lock(&init_lock);
+        if (atomic_load(&initialized) == 0) {
+            first = 1;
+            // Chunks are mapped on demand by grow_heap()
+#ifndef FREESTANDING
+            pthread_key_create(&tcache_key, tcache_exit);
+            if (!mymalloc_debug) {
+                mymalloc_debug = debug_flags_from_env();
+            }
+            const char *sample = getenv("MYMALLOC_SAMPLE");
+            if (sample) {
+                mymalloc_sample_interval = strtoul(sample, NULL, 0);
+            }
+#endif
+            for (size_t i = 0, c = 0; i <= SMALL_MAX / 8; i++) {
+                while (class_size[c] < i * 8) c++;
+                size_to_class[i] = c;
+            }
+            atomic_store(&initialized, 1);
+        }
+        spin_unlock(&init_lock);
+#ifndef FREESTANDING
+        // Outside init_lock: registering the handlers may call malloc()
+        if (first) {
+            pthread_atfork(prefork, postfork, postfork);
+            if (getenv("MYMALLOC_PROFILE")) {
+                atexit(profile_exit);
+            }
+        }
+#else
+        (void)first;
+#endif
+    }
     return 1;
 }
 
-void merge_blocks(freeBlock *block, freeBlock *next) {
-    if((char *)(block) + block->size == (char *)(next)) {
-        // Remove 'next' from free list first
-        if (next->prev) {
-            next->prev->next = next->next;
-        } else {
-            free_list_head = next->next;
+static int in_heap(void *ptr) {
+    return find_chunk(ptr) != NULL;
+}
+
+// The heap a block or slab object was carved from.
+static heap *heap_of(void *ptr) {
+    return find_chunk(ptr)->heap;
+}
+
+// Carve a heap block from our CPU's heap. When that heap cannot grow any
+// more, take the block from the first sibling with a free block that fits.
+static void *heap_alloc(size_t size) {
+    heap *home = my_heap();
+    lock_heap(home);
+    void *addr = find_address(home, size);
+    unlock_heap(home);
+
+    for (int i = 1; !addr && i < NR_HEAPS; i++) {
+        heap *h = &heaps[(home - heaps + i) % NR_HEAPS];
+        lock_heap(h);
+        freeBlock *block = find_free_block(h, size);
+        if (block) {
+            split_block(h, block, size);
+            addr = (char *)block + sizeof(size_t);
         }
-        if (next->next) {
-            next->next->prev = next->prev;
+        unlock_heap(h);
+        if (addr) {
+            stat_add(&STATS->heap_steals, 1);
         }
-        
-        // Now merge the sizes
-        block->size += next->size;
     }
+    return addr;
 }
 
-void insert_into_free_list(freeBlock *block) {
-    freeBlock *prev = find_previous_block(block);
-    freeBlock *next = find_next_block(block);
-    
-    // Insert at the beginning if no previous block
-    if (!prev) {
-        block->prev = NULL;
-        block->next = free_list_head;
-        if (free_list_head) {
-            free_list_head->prev = block;
-        }
-        free_list_head = block;
+// align is a power of two; mappings are page-aligned, so the payload only
+// moves off the header when align asks for more than the header gives.
+// With guard, the payload is pushed to the end of the mapping instead, right
+// against one more page that is made inaccessible.
+static void *large_alloc(size_t size, size_t align, int guard) {
+    size_t pad = align > ALIGNMENT ? align : 0;
+    if (size > SIZE_MAX - LARGE_HEADER - 2 * PAGE_SIZE - pad) {
+        return NULL;
+    }
+    size_t bytes = (LARGE_HEADER + pad + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (guard) {
+        bytes += PAGE_SIZE;
+    }
+    chunk *c = map_pages(bytes);
+    if (!c) {
+        return NULL;
+    }
+    c->size = bytes;
+    c->prev = c->next = NULL;
+    c->heap = NULL;
+    uintptr_t ptr = (uintptr_t)c + LARGE_HEADER;
+    if (pad) {
+        ptr = (ptr + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    if (guard) {
+        uintptr_t end = (uintptr_t)c + bytes - PAGE_SIZE;
+        ptr = (end - size) & ~(uintptr_t)(align - 1);
+#ifndef FREESTANDING
+        vmguard((void *)end, PAGE_SIZE);
+#endif
+    }
+    c->payload = (void *)ptr;
+    OBJ_HEADER(ptr) = bytes | TAG_LARGE | TAG_IN_USE;
+    stat_add(&STATS->bytes_in_use, c->size - (ptr - (uintptr_t)c));
+
+    // Only the pages up to the pointer are registered: that is all
+    // find_chunk() is ever asked about. A guarded block is handed to
+    // debug_alloc(), whose payload sits past a header and may start a page
+    // later, so there every page short of the guard is. No heap lock is
+    // needed for either.
+    c->registered = guard ? bytes - PAGE_SIZE : ptr + 1 - (uintptr_t)c;
+    int ok = reserve_mapped(bytes);
+    if (ok && !pagemap_set(c, c->registered, c)) {
+        unreserve_mapped(bytes);
+        ok = 0;
+    }
+
+    if (!ok) {
+        stat_add(&STATS->bytes_in_use, -(long)(c->size - (ptr - (uintptr_t)c)));
+        unmap_pages(c, bytes);
+        return NULL;
+    }
+    return (void *)ptr;
+}
+
+static void large_free(void *ptr) {
+    chunk *c = find_chunk(ptr);
+    size_t tag = OBJ_HEADER(ptr);
+    // Double free, or not the start of a mapping: silently ignore
+    if (ptr != c->payload || !(tag & TAG_IN_USE) || (tag & ~TAG_MASK) != c->size) {
         return;
     }
-    
-    // Insert between prev and next
-    prev->next = block;
-    block->prev = prev;
-    block->next = next;
-    if (next) {
-        next->prev = block;
+#ifndef FREESTANDING
+    if (atomic_load_explicit(&c->sampled, memory_order_relaxed)) {
+        profile_forget(ptr);
+    }
+#endif
+
+    stat_add(&STATS->nr_free, 1);
+    stat_add(&STATS->bytes_in_use, -(long)(c->size - ((char *)ptr - (char *)c)));
+    size_t bytes = c->size;
+    pagemap_set(c, c->registered, NULL);
+    unmap_pages(c, bytes);
+    unreserve_mapped(bytes);
+}
+
+// Carve a new slab for class c out of h. Caller holds h->lock.
+static slab *new_slab(heap *h, int c) {
+    size_t slot = ALIGN_UP(sizeof(size_t) + class_size[c]);
+    size_t bytes = SLAB_HEADER + SLAB_MAX_OBJS * slot;
+    if (bytes > SLAB_SIZE) bytes = SLAB_SIZE;
+
+    slab *s = find_address(h, bytes);
+    if (!s) {
+        return NULL;
+    }
+#ifndef FREESTANDING
+    // tagged_pop() may read the link word of a batch that another thread
+    // has just popped and freed, so a chunk that ever held a slab has to
+    // stay readable for good: being off the central lists now is not
+    // enough. The cost is address space, not RSS: once these chunks are
+    // free, a purge hands back all but their headers' pages (about 1% of
+    // the peak small-object footprint). Freestanding builds have no
+    // central lists to outlive the slab.
+    find_chunk(s)->keep_mapped = 1;
+#endif
+    char *objs = (char *)s + SLAB_HEADER;
+
+    s->magic = SLAB_MAGIC;
+    s->cls = c;
+    s->nr_objs = (bytes - SLAB_HEADER) / slot;
+    s->nr_free = s->nr_objs;
+    s->free = NULL;
+    atomic_store_explicit(&s->owner, NULL, memory_order_relaxed);
+    atomic_store_explicit(&s->sampled, 0, memory_order_relaxed);
+    for (int i = s->nr_objs - 1; i >= 0; i--) {
+        char *obj = objs + i * slot + sizeof(size_t);
+        OBJ_HEADER(obj) = (uintptr_t)s | TAG_SLAB;
+        *(void **)obj = s->free;
+        s->free = obj;
+    }
+
+    s->prev = NULL;
+    s->next = h->partial_slabs[c];
+    if (s->next) {
+        s->next->prev = s;
+    }
+    h->partial_slabs[c] = s;
+    return s;
+}
+
+static void unlink_slab(heap *h, slab *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        h->partial_slabs[s->cls] = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+// Take one free object of class c from h. Caller holds h->lock.
+static void *slab_alloc(heap *h, int c) {
+    slab *s = h->partial_slabs[c];
+    if (!s && !(s = new_slab(h, c))) {
+        return NULL;
+    }
+    void *obj = s->free;
+    s->free = *(void **)obj;
+    if (--s->nr_free == 0) {
+        unlink_slab(h, s);
+    }
+    return obj;
+}
+
+// Put an object back into its slab, which lives in h. A slab that becomes
+// empty goes back to the heap unless it is the last one of its class.
+// Caller holds h->lock.
+static void slab_free(heap *h, void *obj) {
+    slab *s = (slab *)(OBJ_HEADER(obj) & ~(size_t)7);
+    *(void **)obj = s->free;
+    s->free = obj;
+    if (s->nr_free++ == 0) {
+        s->prev = NULL;
+        s->next = h->partial_slabs[s->cls];
+        if (s->next) {
+            s->next->prev = s;
+        }
+        h->partial_slabs[s->cls] = s;
+    }
+    if (s->nr_free == s->nr_objs && (s->prev || s->next)) {
+        unlink_slab(h, s);
+        s->magic = 0;
+        release_block(h, (freeBlock *)((char *)s - sizeof(size_t)));
+    }
+}
+
+#ifndef FREESTANDING
+static void tcache_register(void) {
+    // A retired cache is off stats_list for good: linking it again would
+    // leave it there once the thread is gone, and a new thread reusing the
+    // TLS block would link it to itself.
+    if (tcache.registered) {
+        return;
+    }
+    // The key's destructor hands the cache back when the thread exits.
+    // Mark the cache first: pthread_setspecific() may itself allocate.
+    tcache.registered = 1;
+    pthread_setspecific(tcache_key, &tcache);
+
+    // Take over an exited thread's remote list, or carve a new one. Lists
+    // are never unmapped, so a slab's owner pointer always stays valid.
+    spin_lock(&stats_lock);
+    remote_free *rf = remote_pool;
+    if (rf) {
+        remote_pool = rf->next;
+    }
+    spin_unlock(&stats_lock);
+    if (!rf) {
+        rf = heap_alloc(sizeof(remote_free));
+    }
+    if (rf) {
+        rf->next = NULL;
+        atomic_store_explicit(&rf->head, NULL, memory_order_release);
+    }
+    tcache.remote = rf;
+
+    spin_lock(&stats_lock);
+    tcache.stats.next = stats_list;
+    stats_list = &tcache.stats;
+    spin_unlock(&stats_lock);
+}
+
+static void count_malloc(long n) {
+    if (tcache.registered < 0) {
+        atomic_fetch_add(&malloc_count, n);
+        return;
+    }
+    if ((tcache.malloc_count += n) >= TCACHE_COUNT_FLUSH) {
+        atomic_fetch_add(&malloc_count, tcache.malloc_count);
+        tcache.malloc_count = 0;
+        // tcache_alloc() only looks at the remote list when a bin runs dry,
+        // which a thread that frees as much as it allocates may never do.
+        // A thread that stops allocating altogether keeps what it was sent
+        // until its next call or its exit.
+        tcache_reclaim();
+    }
+}
+
+// Frees of obj from other threads will come back to our cache.
+static void claim_obj(void *obj) {
+    slab *s = (slab *)(OBJ_HEADER(obj) & ~(size_t)7);
+    atomic_store_explicit(&s->owner, tcache.remote, memory_order_relaxed);
+}
+
+static void tcache_put(int c, void *obj) {
+    claim_obj(obj);
+    *(void **)obj = tcache.bins[c];
+    tcache.bins[c] = obj;
+    tcache.count[c]++;
+    tcache.bytes += class_size[c];
+}
+
+// Move up to one batch of class-c objects into the cache: from the central
+// list if it has any, otherwise from our heap's slabs.
+static void tcache_refill(int c) {
+    int n = TCACHE_BATCH_BYTES / (class_size[c] + sizeof(size_t));
+    if (n > TCACHE_BATCH) n = TCACHE_BATCH;
+    if (n < 1) n = 1;
+
+    void *obj = tagged_pop(&central[c], CENTRAL_LINK);
+    if (obj) {
+        while (obj) {
+            void *next = *(void **)obj;
+            tcache_put(c, obj);
+            obj = next;
+        }
+        return;
+    }
+
+    heap *h = my_heap();
+    lock_heap(h);
+    for (int i = 0; i < n; i++) {
+        obj = slab_alloc(h, c);
+        if (!obj) {
+            break;
+        }
+        tcache_put(c, obj);
+    }
+    unlock_heap(h);
+}
+
+// Give a NULL-terminated list of objects back to their slabs. Each object
+// goes to its own heap; the lock is only switched when that changes, which
+// is rare.
+static void slab_free_list(void *list) {
+    heap *locked = NULL;
+    while (list) {
+        void *obj = list;
+        list = *(void **)obj;
+        heap *h = heap_of(obj);
+        if (h != locked) {
+            if (locked) {
+                unlock_heap(locked);
+            }
+            lock_heap(h);
+            locked = h;
+        }
+        slab_free(h, obj);
+    }
+    if (locked) {
+        unlock_heap(locked);
+    }
+}
+
+// Unlink the first n (> 0) objects of bin c; returns the first, *last the
+// last.
+static void *tcache_detach(int c, int n, void **last) {
+    void *first = tcache.bins[c], *obj = first;
+    for (int i = 1; i < n; i++) {
+        obj = *(void **)obj;
+    }
+    tcache.bins[c] = *(void **)obj;
+    tcache.count[c] -= n;
+    tcache.bytes -= n * class_size[c];
+    *last = obj;
+    return first;
+}
+
+// Give class-c objects back until at most `keep` remain: as one batch onto
+// the central list while it has room, otherwise to their slabs.
+static void tcache_drain(int c, int keep) {
+    int n = tcache.count[c] - keep;
+    if (n <= 0) {
+        return;
+    }
+    void *last, *first = tcache_detach(c, n, &last);
+    *(void **)last = NULL;
+    if (class_size[c] > sizeof(void *) &&
+        __atomic_load_n(&central[c].count, __ATOMIC_RELAXED) < CENTRAL_MAX_BATCHES) {
+        tagged_push(&central[c], first, CENTRAL_LINK);
+    } else {
+        slab_free_list(first);
+    }
+}
+
+// Empty the central lists into the slabs, so that slabs left with no live
+// objects go back to the heap.
+static void central_release(void) {
+    for (int c = 0; c < NR_CLASSES; c++) {
+        void *batch = tagged_take_all(&central[c]);
+        while (batch) {
+            void *next = TAGGED_LINK(batch, CENTRAL_LINK);
+            slab_free_list(batch);
+            batch = next;
+        }
+    }
+}
+
+// Move a detached remote_free list into the bins.
+static void tcache_take(void *list) {
+    while (list) {
+        void *obj = list;
+        list = *(void **)obj;
+        tcache_put(((slab *)(OBJ_HEADER(obj) & ~(size_t)7))->cls, obj);
+    }
+}
+
+// Take back everything other threads have freed for us in one exchange,
+// trimming the cache if that pushed it over its byte cap.
+static void tcache_reclaim(void) {
+    remote_free *rf = tcache.remote;
+    if (!rf || !atomic_load_explicit(&rf->head, memory_order_relaxed)) {
+        return;
+    }
+    tcache_take(atomic_exchange_explicit(&rf->head, NULL, memory_order_acquire));
+
+    for (int c = 0; c < NR_CLASSES && tcache.bytes > TCACHE_MAX_BYTES; c++) {
+        tcache_drain(c, tcache.count[c] / 2);
+    }
+}
+
+static void tcache_flush(void) {
+    tcache_reclaim();
+    for (int c = 0; c < NR_CLASSES; c++) {
+        tcache_drain(c, 0);
+    }
+}
+
+static void retire_stats(struct thread_stats *st);
+
+static void tcache_exit(void *arg) {
+    (void)arg;
+    // Close the remote list first so nothing lands in it after the flush
+    remote_free *rf = tcache.remote;
+    tcache.remote = NULL;
+    if (rf) {
+        tcache_take(atomic_exchange_explicit(&rf->head, REMOTE_CLOSED,
+                                             memory_order_acquire));
+    }
+    tcache_flush();
+    if (rf) {
+        spin_lock(&stats_lock);
+        rf->next = remote_pool;
+        remote_pool = rf;
+        spin_unlock(&stats_lock);
+    }
+    atomic_fetch_add(&malloc_count, tcache.malloc_count);
+    tcache.malloc_count = 0;
+    // Dead for good: glibc still frees (and may allocate) after the last
+    // destructor round, when a new cache would never be flushed. Such late
+    // calls go straight to the slabs instead; see small_alloc().
+    tcache.registered = -1;
+    retire_stats(&tcache.stats);
+}
+
+static void *tcache_alloc(int c) {
+    if (!tcache.bins[c]) {
+        tcache_reclaim();
+    }
+    if (!tcache.bins[c]) {
+        tcache_refill(c);
+        if (!tcache.bins[c]) {
+            return NULL;
+        }
+    }
+    void *obj = tcache.bins[c];
+    tcache.bins[c] = *(void **)obj;
+    tcache.count[c]--;
+    tcache.bytes -= class_size[c];
+    return obj;
+}
+
+// Hand an object from another thread's cache back to that thread with a
+// single CAS. Returns 0 if it is ours, or its owner has exited.
+static int remote_push(void *obj, slab *s) {
+    remote_free *owner = atomic_load_explicit(&s->owner, memory_order_relaxed);
+    if (!owner || owner == tcache.remote) {
+        return 0;
+    }
+    void *head = atomic_load_explicit(&owner->head, memory_order_relaxed);
+    do {
+        if (head == REMOTE_CLOSED) {
+            return 0;
+        }
+        *(void **)obj = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->head, &head, obj,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    return 1;
+}
+
+static void tcache_free(void *obj, int c) {
+    *(void **)obj = tcache.bins[c];
+    tcache.bins[c] = obj;
+    tcache.count[c]++;
+    tcache.bytes += class_size[c];
+
+    if (tcache.count[c] > 2 * TCACHE_BATCH || tcache.bytes > TCACHE_MAX_BYTES) {
+        tcache_drain(c, tcache.count[c] / 2);
+    }
+}
+#endif
+
+static void *small_alloc(size_t size) {
+    int c = size_to_class[size / 8];
+    void *obj = NULL;
+#ifndef FREESTANDING
+    // An exited thread has no cache left; see tcache_exit()
+    if (tcache.registered > 0) {
+        obj = tcache_alloc(c);
+        if (!obj) {
+            // Empty slabs held by this thread's cache or the central lists
+            // can go back to the heap.
+            tcache_flush();
+            central_release();
+        }
+    }
+#endif
+    if (!obj) {
+        heap *h = my_heap();
+        lock_heap(h);
+        obj = slab_alloc(h, c);
+        unlock_heap(h);
+    }
+    if (obj) {
+        OBJ_HEADER(obj) |= TAG_IN_USE;
+        stat_add(&STATS->class_allocs[c], 1);
+        stat_add(&STATS->bytes_in_use, class_size[c]);
+    }
+    return obj;
+}
+
+static void small_free(void *ptr) {
+    size_t tag = OBJ_HEADER(ptr);
+    slab *s = (slab *)(tag & ~(size_t)7);
+    // Double free, or not a pointer we handed out: silently ignore
+    if (!(tag & TAG_IN_USE) || !in_heap(s) || s->magic != SLAB_MAGIC) {
+        return;
+    }
+#ifndef FREESTANDING
+    if (atomic_load_explicit(&s->sampled, memory_order_relaxed)) {
+        profile_forget(ptr);
+    }
+#endif
+    OBJ_HEADER(ptr) = tag & ~(size_t)TAG_IN_USE;
+    stat_add(&STATS->nr_free, 1);
+    stat_add(&STATS->class_frees[s->cls], 1);
+    stat_add(&STATS->bytes_in_use, -(long)class_size[s->cls]);
+#ifndef FREESTANDING
+    if (remote_push(ptr, s)) {
+        return;
+    }
+    if (tcache.registered > 0) {
+        tcache_free(ptr, s->cls);
+        return;
+    }
+#endif
+    heap *h = heap_of(ptr);
+    lock_heap(h);
+    slab_free(h, ptr);
+    unlock_heap(h);
+}
+
+// Allocate a checked size, already a multiple of 8.
+static void *place_block(size_t size) {
+    void *addr = NULL;
+    if (size >= large_threshold) {
+        addr = large_alloc(size, ALIGNMENT, 0);
+    } else if (size <= SMALL_MAX) {
+        addr = small_alloc(size);
+        // No room for a new slab: fall back to a plain heap block.
+    }
+
+    if (!addr && size < large_threshold) {
+        addr = heap_alloc(size);
+        if (addr) {
+            stat_add(&STATS->bytes_in_use,
+                     block_size((freeBlock *)((size_t *)addr - 1)) - BLOCK_OVERHEAD);
+        }
+    }
+
+    if (addr) {
+        stat_add(&STATS->nr_malloc, 1);
+    }
+    return addr;
+}
+
+static void *alloc_block(size_t size) {
+    if (!heap_init()) {
+        return NULL;
+    }
+#ifndef FREESTANDING
+    if (!tcache.registered) {
+        tcache_register();
+    }
+#endif
+
+    // Count all malloc attempts (including size 0)
+#ifndef FREESTANDING
+    count_malloc(1);
+#else
+    atomic_fetch_add(&malloc_count, 1);
+#endif
+    
+    // Ensure 8-byte alignment
+    if (size == 0) return NULL;
+    
+    // Check for overflow and unreasonably large sizes
+    if (size > heap_limit || size > SIZE_MAX - sizeof(freeBlock) - PAGE_SIZE) {
+        return NULL;
+    }
+    
+    size = (size + 7) & ~7;  // Round up to 8-byte boundary
+    return place_block(size);
+}
+
+static void free_block(void *ptr) {
+    if(ptr == NULL) {
+        return;
+    }
+    if (!in_heap(ptr)) {
+        return;
+    }
+#ifndef FREESTANDING
+    if (!tcache.registered) {
+        tcache_register();
+    }
+#endif
+    if (OBJ_HEADER(ptr) & TAG_SLAB) {
+        small_free(ptr);
+        return;
+    }
+    if (OBJ_HEADER(ptr) & TAG_LARGE) {
+        large_free(ptr);
+        return;
+    }
+
+    freeBlock *block = (freeBlock *)((char *)ptr - sizeof(size_t));
+    if(!is_valid_block(block)) {
+        return;
+    }
+
+    // Double free: silently ignore
+    if (!(block->size & TAG_IN_USE)) {
+        return;
+    }
+
+    chunk *c = find_chunk(block);
+#ifndef FREESTANDING
+    if (atomic_load_explicit(&c->sampled, memory_order_relaxed)) {
+        profile_forget(ptr);
+    }
+#endif
+    stat_add(&STATS->nr_free, 1);
+    stat_add(&STATS->bytes_in_use, -(long)(block_size(block) - BLOCK_OVERHEAD));
+    heap *h = c->heap;
+    lock_heap(h);
+    release_block(h, block);
+    unlock_heap(h);
+}
+
+// No libc in freestanding builds.
+#ifndef FREESTANDING
+#define mem_copy(dst, src, n) memcpy(dst, src, n)
+#define mem_zero(dst, n)      memset(dst, 0, n)
+#else
+static void mem_copy(void *dst, const void *src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ((char *)dst)[i] = ((const char *)src)[i];
+    }
+}
+
+static void mem_zero(void *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        ((char *)dst)[i] = 0;
+    }
+}
+#endif
+
+// Usable bytes behind a live block, or 0 if ptr is not one.
+static size_t usable_size(void *ptr) {
+    if (!ptr || !in_heap(ptr)) {
+        return 0;
+    }
+    size_t tag = OBJ_HEADER(ptr);
+    if (!(tag & TAG_IN_USE)) {
+        return 0;
+    }
+    if (tag & TAG_SLAB) {
+        slab *s = (slab *)(tag & ~TAG_MASK);
+        return in_heap(s) && s->magic == SLAB_MAGIC ? class_size[s->cls] : 0;
+    }
+    if (tag & TAG_LARGE) {
+        chunk *c = find_chunk(ptr);
+        if (ptr != c->payload || (tag & ~TAG_MASK) != c->size) {
+            return 0;
+        }
+        return c->size - ((char *)ptr - (char *)c);
+    }
+    freeBlock *block = (freeBlock *)((char *)ptr - sizeof(size_t));
+    return is_valid_block(block) ? block_size(block) - BLOCK_OVERHEAD : 0;
+}
+
+// Resize an in-use block of h without moving it: grow into the free block
+// to its right, or give the tail back. Returns 0 if there is no room.
+// Caller holds h->lock.
+static int resize_block(heap *h, freeBlock *block, size_t size) {
+    size_t need = block_need(size);
+    size_t total = block_size(block);
+    if (need > total) {
+        freeBlock *next = (freeBlock *)((char *)block + total);
+        if ((next->size & TAG_IN_USE) || total + block_size(next) < need) {
+            return 0;
+        }
+        remove_from_free_list(h, next);
+        total += block_size(next);
+    }
+
+    if (total - need >= MIN_BLOCK) {
+        freeBlock *rest = (freeBlock *)((char *)block + need);
+        set_block(block, need, TAG_IN_USE);
+        set_block(rest, total - need, TAG_IN_USE);
+        release_block(h, rest);
+    } else {
+        set_block(block, total, TAG_IN_USE);
+    }
+    return 1;
+}
+
+static void *realloc_block(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return alloc_block(size);
+    }
+    if (size == 0) {
+        free_block(ptr);
+        return NULL;
+    }
+    size_t old = usable_size(ptr);
+    if (!old || size > heap_limit || size > SIZE_MAX - sizeof(freeBlock) - PAGE_SIZE) {
+        return NULL;
+    }
+#ifndef FREESTANDING
+    if (!tcache.registered) {
+        tcache_register();
+    }
+#endif
+    size = (size + 7) & ~(size_t)7;
+
+    size_t tag = OBJ_HEADER(ptr);
+    if (tag & TAG_SLAB) {
+        if (size <= old) {
+            return ptr;
+        }
+    } else if (tag & TAG_LARGE) {
+        if (size <= old && size >= large_threshold) {
+            return ptr;
+        }
+    } else if (size < large_threshold) {
+        freeBlock *block = (freeBlock *)((char *)ptr - sizeof(size_t));
+        heap *h = heap_of(block);
+        lock_heap(h);
+        int ok = resize_block(h, block, size);
+        unlock_heap(h);
+        if (ok) {
+            stat_add(&STATS->bytes_in_use, (long)(block_size(block) - BLOCK_OVERHEAD) - (long)old);
+            return ptr;
+        }
+    }
+
+    void *fresh = alloc_block(size);
+    if (!fresh) {
+        return NULL;
+    }
+    mem_copy(fresh, ptr, old < size ? old : size);
+    free_block(ptr);
+    return fresh;
+}
+
+static void *calloc_block(size_t nmemb, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        return NULL;
+    }
+    void *ptr = alloc_block(total);
+    // A large allocation is fresh pages, which read as zeros
+    if (ptr && !(OBJ_HEADER(ptr) & TAG_LARGE)) {
+        mem_zero(ptr, total);
+    }
+    return ptr;
+}
+
+// alignment must be a power of two. Slab objects are only ALIGNMENT-aligned,
+// so stricter requests come from the heap or a large mapping.
+static void *memalign_block(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return alloc_block(size);
+    }
+    if (!heap_init()) {
+        return NULL;
+    }
+#ifndef FREESTANDING
+    if (!tcache.registered) {
+        tcache_register();
+    }
+#endif
+    if (size == 0 || size > heap_limit || alignment > heap_limit ||
+        size > SIZE_MAX - sizeof(freeBlock) - PAGE_SIZE - alignment - MIN_BLOCK) {
+        return NULL;
+    }
+    size = (size + 7) & ~(size_t)7;
+
+    void *addr = NULL;
+    if (size + alignment >= large_threshold) {
+        addr = large_alloc(size, alignment, 0);
+        if (addr) {
+            stat_add(&STATS->nr_malloc, 1);
+        }
+        return addr;
+    }
+
+    // Over-allocate, then hand the misaligned front back to the heap. The
+    // front must be big enough to stand alone as a free block.
+    heap *h = my_heap();
+    lock_heap(h);
+    char *raw = find_address(h, size + alignment + MIN_BLOCK);
+    if (raw) {
+        freeBlock *block = (freeBlock *)(raw - sizeof(size_t));
+        uintptr_t p = ((uintptr_t)raw + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        while (p != (uintptr_t)raw && p - (uintptr_t)raw < MIN_BLOCK) {
+            p += alignment;
+        }
+        size_t front = p - (uintptr_t)raw;
+        freeBlock *aligned = (freeBlock *)(p - sizeof(size_t));
+        if (front) {
+            set_block(aligned, block_size(block) - front, TAG_IN_USE);
+            set_block(block, front, TAG_IN_USE);
+            release_block(h, block);
+        }
+        resize_block(h, aligned, size);
+        addr = (void *)p;
+        stat_add(&STATS->bytes_in_use, block_size(aligned) - BLOCK_OVERHEAD);
+        stat_add(&STATS->nr_malloc, 1);
+    }
+    unlock_heap(h);
+    return addr;
+}
+
+#ifndef FREESTANDING
+// Debug mode: every block gets a debug_header in front of the payload and,
+// with MYMALLOC_DEBUG_CANARY, DEBUG_REDZONE bytes of redzone (plus the
+// rounding slack) behind it; both are checked when the block is freed.
+// The cost per call stays bounded, so it can run under real load: the
+// header and redzone, at most DEBUG_POISON_MAX bytes poisoned and checked
+// again per quarantined block, and at most QUARANTINE_BYTES held back.
+#define DEBUG_REDZONE    16
+#define DEBUG_POISON_MAX 256
+#define REDZONE_BYTE     0xfd
+#define POISON_BYTE      0xdd
+#define DEBUG_LIVE       0x6d6d616c6c6f6321ull
+#define DEBUG_FREED      0x6d6d667265656421ull
+
+typedef struct debug_header {
+    size_t size;       // bytes requested
+    void *alloc_site;
+    void *free_site;
+    uint32_t offset;   // payload - start of the underlying block
+    uint32_t tail;     // redzone bytes after the payload
+    uint64_t canary;   // DEBUG_LIVE or DEBUG_FREED, xor the payload address
+} debug_header;
+
+#define DEBUG_HEADER(ptr) ((debug_header *)(ptr) - 1)
+
+static void format_site(char *buf, size_t len, void *site) {
+    Dl_info info;
+    if (dladdr(site, &info) && info.dli_fname) {
+        snprintf(buf, len, "%p (%s+%#lx%s%s)", site, info.dli_fname,
+                 (unsigned long)((char *)site - (char *)info.dli_fbase),
+                 info.dli_sname ? " " : "", info.dli_sname ? info.dli_sname : "");
+    } else {
+        snprintf(buf, len, "%p", site);
+    }
+}
+
+// Written straight to fd 2: stdio could allocate. hdr is NULL when it
+// cannot be trusted; site is NULL when the error was found later on.
+static void debug_report(const char *what, void *ptr, debug_header *hdr, void *site) {
+    char buf[1024], where[256];
+    size_t n = snprintf(buf, sizeof(buf), "mymalloc: %s, block %p", what, ptr);
+    if (hdr) {
+        n += snprintf(buf + n, sizeof(buf) - n, " (%zu bytes)", hdr->size);
+        format_site(where, sizeof(where), hdr->alloc_site);
+        n += snprintf(buf + n, sizeof(buf) - n, "\n  allocated at %s", where);
+        if (hdr->free_site && n < sizeof(buf)) {
+            format_site(where, sizeof(where), hdr->free_site);
+            n += snprintf(buf + n, sizeof(buf) - n, "\n  freed at %s", where);
+        }
+    }
+    if (site && n < sizeof(buf)) {
+        format_site(where, sizeof(where), site);
+        n += snprintf(buf + n, sizeof(buf) - n, "\n  detected at %s", where);
+    }
+    if (n < sizeof(buf)) {
+        n += snprintf(buf + n, sizeof(buf) - n, "\n");
+    }
+    if (write(2, buf, n < sizeof(buf) ? n : sizeof(buf) - 1) < 0) {
+        // nowhere else to report it
+    }
+    atomic_fetch_add(&debug_errors, 1);
+    if (mymalloc_debug & MYMALLOC_DEBUG_ABORT) {
+        abort();
+    }
+}
+
+// The header of a live debug block, or NULL if ptr is not one.
+static debug_header *debug_live(void *ptr) {
+    if (!in_heap(ptr) || find_chunk(DEBUG_HEADER(ptr)) != find_chunk(ptr)) {
+        return NULL;
+    }
+    debug_header *hdr = DEBUG_HEADER(ptr);
+    return hdr->canary == (DEBUG_LIVE ^ (uintptr_t)ptr) ? hdr : NULL;
+}
+
+// alignment is a power of two, at least ALIGNMENT.
+static void *debug_alloc(size_t size, size_t alignment, void *site) {
+    size_t offset = (sizeof(debug_header) + alignment - 1) & ~(alignment - 1);
+    if (size == 0 || offset > UINT32_MAX || size > SIZE_MAX - offset - DEBUG_REDZONE - 2 * PAGE_SIZE) {
+        return NULL;
+    }
+    size_t slack = -size & 7;
+    size_t total = offset + size + slack;
+    char *raw;
+    if ((mymalloc_debug & MYMALLOC_DEBUG_GUARD) && total >= large_threshold) {
+        if (!tcache.registered) {
+            tcache_register();
+        }
+        count_malloc(1);
+        raw = total <= heap_limit ? large_alloc(total, alignment, 1) : NULL;
+        if (raw) {
+            stat_add(&STATS->nr_malloc, 1);
+        }
+    } else {
+        if (mymalloc_debug & MYMALLOC_DEBUG_CANARY) {
+            total += DEBUG_REDZONE;
+        }
+        raw = alignment > ALIGNMENT ? memalign_block(alignment, total)
+                                         : alloc_block(total);
+    }
+    if (!raw) {
+        return NULL;
+    }
+
+    char *ptr = raw + offset;
+    debug_header *hdr = DEBUG_HEADER(ptr);
+    hdr->size = size;
+    hdr->alloc_site = site;
+    hdr->free_site = NULL;
+    hdr->offset = offset;
+    hdr->tail = total - offset - size;
+    hdr->canary = DEBUG_LIVE ^ (uintptr_t)ptr;
+    memset(ptr + size, REDZONE_BYTE, hdr->tail);
+    return ptr;
+}
+
+// A quarantined block is handed back for good: anything written to it
+// while it waited is a use after free.
+static void quarantine_release(void *ptr) {
+    debug_header *hdr = DEBUG_HEADER(ptr);
+    if (hdr->canary != (DEBUG_FREED ^ (uintptr_t)ptr)) {
+        debug_report("header of a freed block overwritten", ptr, NULL, NULL);
+        return;  // leak it rather than trust the header
+    }
+    size_t n = hdr->size < DEBUG_POISON_MAX ? hdr->size : DEBUG_POISON_MAX;
+    for (size_t i = 0; i < n; i++) {
+        if (((unsigned char *)ptr)[i] != POISON_BYTE) {
+            debug_report("write after free", ptr, hdr, NULL);
+            break;
+        }
+    }
+    hdr->canary = 0;
+    free_block((char *)ptr - hdr->offset);
+}
+
+// Caller holds quarantine.lock.
+static void *quarantine_pop(void) {
+    void *ptr = quarantine.ring[quarantine.head];
+    quarantine.head = (quarantine.head + 1) % QUARANTINE_SLOTS;
+    quarantine.count--;
+    quarantine.bytes -= DEBUG_HEADER(ptr)->size;
+    return ptr;
+}
+
+static void quarantine_push(void *ptr) {
+    spin_lock(&quarantine.lock);
+    void *old = quarantine.count == QUARANTINE_SLOTS ? quarantine_pop() : NULL;
+    quarantine.ring[(quarantine.head + quarantine.count) % QUARANTINE_SLOTS] = ptr;
+    quarantine.count++;
+    quarantine.bytes += DEBUG_HEADER(ptr)->size;
+    if (!old && quarantine.bytes > QUARANTINE_BYTES) {
+        old = quarantine_pop();
+    }
+    spin_unlock(&quarantine.lock);
+
+    // Checking and freeing happen outside the lock.
+    while (old) {
+        quarantine_release(old);
+        spin_lock(&quarantine.lock);
+        old = quarantine.bytes > QUARANTINE_BYTES ? quarantine_pop() : NULL;
+        spin_unlock(&quarantine.lock);
+    }
+}
+
+static void debug_free(void *ptr, void *site) {
+    debug_header *hdr = debug_live(ptr);
+    if (!hdr) {
+        if (in_heap(ptr) && find_chunk(DEBUG_HEADER(ptr)) == find_chunk(ptr) &&
+            DEBUG_HEADER(ptr)->canary == (DEBUG_FREED ^ (uintptr_t)ptr)) {
+            debug_report("double free", ptr, DEBUG_HEADER(ptr), site);
+        } else {
+            debug_report("free of a pointer not from mymalloc, or of a block "
+                         "whose header was overwritten", ptr, NULL, site);
+        }
+        return;
+    }
+    unsigned char *tail = (unsigned char *)ptr + hdr->size;
+    for (size_t i = 0; i < hdr->tail; i++) {
+        if (tail[i] != REDZONE_BYTE) {
+            debug_report("heap buffer overflow", ptr, hdr, site);
+            break;
+        }
+    }
+
+    hdr->free_site = site;
+    hdr->canary = DEBUG_FREED ^ (uintptr_t)ptr;
+    if (mymalloc_debug & MYMALLOC_DEBUG_QUARANTINE) {
+        memset(ptr, POISON_BYTE, hdr->size < DEBUG_POISON_MAX ? hdr->size : DEBUG_POISON_MAX);
+        quarantine_push(ptr);
+    } else {
+        free_block((char *)ptr - hdr->offset);
+    }
+}
+
+// Always moves the block, so stale pointers to the old one stand out.
+static void *debug_realloc(void *ptr, size_t size, void *site) {
+    if (ptr == NULL) {
+        return debug_alloc(size, ALIGNMENT, site);
+    }
+    if (size == 0) {
+        debug_free(ptr, site);
+        return NULL;
+    }
+    debug_header *hdr = debug_live(ptr);
+    if (!hdr) {
+        debug_report("realloc of a pointer not from mymalloc", ptr, NULL, site);
+        return NULL;
+    }
+    void *fresh = debug_alloc(size, ALIGNMENT, site);
+    if (!fresh) {
+        return NULL;
+    }
+    memcpy(fresh, ptr, hdr->size < size ? hdr->size : size);
+    debug_free(ptr, site);
+    return fresh;
+}
+#endif
+
+#ifndef FREESTANDING
+// Sampling heap profiler. Each thread counts down the bytes it allocates;
+// the allocation that takes the count below zero gets its backtrace
+// recorded, and the count restarts from an exponentially distributed
+// distance with mean mymalloc_sample_interval. Sampling is then a Poisson
+// process over bytes: a block of size s is sampled with probability
+// 1 - e^(-s / interval) whatever the allocation pattern around it, and the
+// fast path costs one subtraction and one branch.
+
+// -ln(u) for 0 < u <= 1, without libm.
+static double neg_log(double u) {
+    int k = 0;
+    while (u < 0.5) {
+        u *= 2;
+        k++;
+    }
+    // ln u = 2 atanh((u - 1) / (u + 1)), with |(u - 1) / (u + 1)| <= 1/3
+    double t = (u - 1) / (u + 1), t2 = t * t, term = t, sum = 0;
+    for (int i = 1; i < 30; i += 2) {
+        sum += term / i;
+        term *= t2;
+    }
+    return k * 0.6931471805599453 - 2 * sum;
+}
+
+// e^(-x) for x >= 0, without libm.
+static double exp_neg(double x) {
+    int halvings = 0;
+    while (x > 0.5 && halvings < 64) {
+        x /= 2;
+        halvings++;
+    }
+    double term = 1, sum = 1;
+    for (int i = 1; i < 12; i++) {
+        term *= -x / i;
+        sum += term;
+    }
+    while (halvings--) {
+        sum *= sum;
+    }
+    return sum;
+}
+
+static long sample_distance(void) {
+    uint64_t x = tcache.sample_rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    tcache.sample_rng = x;
+    double u = ((x >> 11) + 1) * 0x1p-53;  // (0, 1]
+    double d = neg_log(u) * mymalloc_sample_interval;
+    return d < (double)LONG_MAX / 2 ? (long)d : LONG_MAX / 2;
+}
+
+struct unwind_state {
+    void **pc;
+    int depth, max;
+};
+
+static _Unwind_Reason_Code unwind_frame(struct _Unwind_Context *ctx, void *arg) {
+    struct unwind_state *st = arg;
+    if (st->depth == st->max) {
+        return _URC_END_OF_STACK;
+    }
+    void *pc = (void *)_Unwind_GetIP(ctx);
+    if (!pc) {
+        return _URC_END_OF_STACK;
+    }
+    st->pc[st->depth++] = pc;
+    return _URC_NO_REASON;
+}
+
+// The unwinder comes straight from libgcc: glibc's backtrace() would
+// dlopen() it, allocating, on its first call.
+static int unwind_stack(void **pc, int max) {
+    struct unwind_state st = {pc, 0, max};
+    _Unwind_Backtrace(unwind_frame, &st);
+    return st.depth;
+}
+
+// Bind and set up the unwinder at load time instead of in the middle of
+// the first sampled allocation, which would take some tens of
+// microseconds longer.
+__attribute__((constructor))
+static void unwind_warm_up(void) {
+    void *pc[2];
+    unwind_stack(pc, 2);
+}
+
+static size_t profile_hash(void *ptr) {
+    return ((uintptr_t)ptr >> 3) * 0x9e3779b97f4a7c15ull >> 52;  // 12 bits
+}
+
+// The next allocation of size bytes is to be sampled.
+static inline int sample_due(size_t size) {
+    return (tcache.sample_left -= (long)size) < 0;
+}
+
+// The counter of live samples that a free of block checks.
+static atomic_int *sample_count(void *block) {
+    size_t tag = OBJ_HEADER(block);
+    if (tag & TAG_SLAB) {
+        return &((slab *)(tag & ~TAG_MASK))->sampled;
+    }
+    return &find_chunk(block)->sampled;
+}
+
+// Record ptr, allocated from site, as the countdown ran out on it; returns
+// ptr.
+static void *take_sample(void *ptr, size_t size, void *site) {
+    if (!mymalloc_sample_interval) {
+        tcache.sample_left = 64 << 20;  // look again later on
+        return ptr;
+    }
+    // Restart the countdown first, in case the unwinder allocates
+    if (!tcache.sample_rng) {
+        // The first countdown started at 0 rather than at a random
+        // distance: draw one without sampling, not to favour first calls.
+        tcache.sample_rng = ((uintptr_t)&tcache ^ (uint64_t)now_ms() << 20) | 1;
+        tcache.sample_left = sample_distance();
+        return ptr;
+    }
+    tcache.sample_left = sample_distance();
+    if (!ptr) {
+        return NULL;
+    }
+
+    // Drop our own frames: keep the stack from the caller's site on
+    void *stack[PROFILE_DEPTH + 8];
+    int depth = unwind_stack(stack, PROFILE_DEPTH + 8), skip = 0;
+    for (int i = 0; i < depth; i++) {
+        if (stack[i] == site) {
+            skip = i;
+            break;
+        }
+    }
+    depth -= skip;
+    if (depth > PROFILE_DEPTH) {
+        depth = PROFILE_DEPTH;
+    }
+
+    spin_lock(&profile.lock);
+    profile_sample *e = profile.pool;
+    if (e) {
+        profile.pool = e->next;
+    } else if (profile.used < PROFILE_SLOTS) {
+        e = &profile.entries[profile.used++];
+    }
+    if (!e) {
+        // Table full: the sample is lost
+        spin_unlock(&profile.lock);
+        return ptr;
+    }
+    // In debug mode the table holds the underlying block, which is what
+    // reaches the free paths
+    void *block = mymalloc_debug ? (char *)ptr - DEBUG_HEADER(ptr)->offset : ptr;
+    e->block = block;
+    e->size = size;
+    e->interval = mymalloc_sample_interval;
+    e->depth = depth;
+    memcpy(e->stack, stack + skip, depth * sizeof(void *));
+    size_t b = profile_hash(block);
+    e->next = profile.buckets[b];
+    profile.buckets[b] = e;
+    atomic_fetch_add_explicit(sample_count(block), 1, memory_order_relaxed);
+    spin_unlock(&profile.lock);
+    return ptr;
+}
+
+// Drop the sample of block, which is being freed: its address may be
+// handed out (and sampled) again as soon as that is done.
+static void profile_forget(void *block) {
+    size_t b = profile_hash(block);
+    spin_lock(&profile.lock);
+    for (profile_sample **pp = &profile.buckets[b]; *pp; pp = &(*pp)->next) {
+        profile_sample *e = *pp;
+        if (e->block == block) {
+            *pp = e->next;
+            e->next = profile.pool;
+            profile.pool = e;
+            atomic_fetch_sub_explicit(sample_count(block), 1, memory_order_relaxed);
+            break;
+        }
+    }
+    spin_unlock(&profile.lock);
+}
+
+// realloc() may resize ptr where it is: drop its sample first.
+static void profile_unsample(void *ptr) {
+    void *block = ptr;
+    if (mymalloc_debug) {
+        debug_header *hdr = debug_live(ptr);
+        if (!hdr) {
+            return;
+        }
+        block = (char *)ptr - hdr->offset;
+    }
+    if (usable_size(block) &&
+        atomic_load_explicit(sample_count(block), memory_order_relaxed)) {
+        profile_forget(block);
+    }
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One folded-stack frame: the symbol if the dynamic symbol table has it,
+// otherwise module+offset.
+static size_t format_frame(char *buf, size_t len, void *pc) {
+    Dl_info info;
+    int found = dladdr(pc, &info);
+    if (found && info.dli_sname) {
+        return snprintf(buf, len, "%s", info.dli_sname);
+    }
+    if (found && info.dli_fname) {
+        const char *base = strrchr(info.dli_fname, '/');
+        return snprintf(buf, len, "%s+%#lx", base ? base + 1 : info.dli_fname,
+                        (unsigned long)((char *)pc - (char *)info.dli_fbase));
+    }
+    return snprintf(buf, len, "%p", pc);
+}
+
+// Write the live samples to fd. MYMALLOC_PROFILE_PPROF gives a legacy
+// (gperftools) heap profile, one sample per line with its size, which
+// pprof scales up itself; the memory map it needs for symbols follows.
+// MYMALLOC_PROFILE_FOLDED gives "outermost;...;site bytes" lines, bytes
+// being the estimated total the sample stands for, for flamegraph.pl.
+// Returns the number of samples written, or -1 on a write error.
+int mymalloc_profile_dump(int fd, int format) {
+    char line[4096];
+    int err = 0;
+    spin_lock(&profile.lock);
+    long count = 0, bytes = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        for (profile_sample *e = profile.buckets[b]; e; e = e->next) {
+            count++;
+            bytes += e->size;
+        }
+    }
+    if (format == MYMALLOC_PROFILE_PPROF) {
+        size_t n = snprintf(line, sizeof(line), "heap profile: %ld: %ld [ %ld: %ld] @ heap_v2/%zu\n",
+                            count, bytes, count, bytes, mymalloc_sample_interval);
+        err |= write_all(fd, line, n);
+    }
+    for (int b = 0; b < PROFILE_BUCKETS && !err; b++) {
+        for (profile_sample *e = profile.buckets[b]; e && !err; e = e->next) {
+            size_t n = 0;
+            if (format == MYMALLOC_PROFILE_PPROF) {
+                n = snprintf(line, sizeof(line), "1: %zu [1: %zu] @", e->size, e->size);
+                for (int i = 0; i < e->depth && n < sizeof(line) - 20; i++) {
+                    n += snprintf(line + n, sizeof(line) - n, " %p", e->stack[i]);
+                }
+            } else {
+                for (int i = e->depth - 1; i >= 0 && n < sizeof(line) - 64; i--) {
+                    n += format_frame(line + n, sizeof(line) - 64 - n, e->stack[i]);
+                    if (n > sizeof(line) - 64) {
+                        n = sizeof(line) - 64;
+                    }
+                    if (i) {
+                        line[n++] = ';';
+                    }
+                }
+                double p = 1 - exp_neg((double)e->size / e->interval);
+                n += snprintf(line + n, sizeof(line) - n, " %.0f", e->size / p);
+            }
+            line[n++] = '\n';
+            err |= write_all(fd, line, n);
+        }
+    }
+    spin_unlock(&profile.lock);
+
+    if (format == MYMALLOC_PROFILE_PPROF && !err) {
+        err |= write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+        int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+        ssize_t n;
+        while (maps >= 0 && !err && (n = read(maps, line, sizeof(line))) > 0) {
+            err |= write_all(fd, line, n);
+        }
+        if (maps >= 0) {
+            close(maps);
+        }
+    }
+    return err ? -1 : (int)count;
+}
+
+// MYMALLOC_PROFILE=<file>: dump the samples still live at exit, folded if
+// the name ends in ".folded", otherwise for pprof.
+static void profile_exit(void) {
+    const char *path = getenv("MYMALLOC_PROFILE");
+    int fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd < 0) {
+        return;
+    }
+    size_t len = strlen(path);
+    int folded = len >= 7 && strcmp(path + len - 7, ".folded") == 0;
+    mymalloc_profile_dump(fd, folded ? MYMALLOC_PROFILE_FOLDED : MYMALLOC_PROFILE_PPROF);
+    close(fd);
+}
+#else
+static inline int sample_due(size_t size) {
+    (void)size;
+    return 0;
+}
+
+static void *take_sample(void *ptr, size_t size, void *site) {
+    (void)size;
+    (void)site;
+    return ptr;
+}
+
+static void profile_unsample(void *ptr) {
+    (void)ptr;
+}
+#endif
+
+// The public entry points proper; the _at versions below add sampling.
+static inline void *malloc_site(size_t size, void *site) {
+#ifndef FREESTANDING
+    if (heap_init() && mymalloc_debug) {
+        return debug_alloc(size, ALIGNMENT, site);
+    }
+#endif
+    (void)site;
+    return alloc_block(size);
+}
+
+static inline void *realloc_site(void *ptr, size_t size, void *site) {
+#ifndef FREESTANDING
+    if (heap_init() && mymalloc_debug) {
+        return debug_realloc(ptr, size, site);
+    }
+#endif
+    (void)site;
+    return realloc_block(ptr, size);
+}
+
+static inline void *calloc_site(size_t nmemb, size_t size, void *site) {
+#ifndef FREESTANDING
+    if (heap_init() && mymalloc_debug) {
+        size_t total;
+        if (__builtin_mul_overflow(nmemb, size, &total)) {
+            return NULL;
+        }
+        void *ptr = debug_alloc(total, ALIGNMENT, site);
+        if (ptr) {
+            memset(ptr, 0, total);
+        }
+        return ptr;
+    }
+#endif
+    (void)site;
+    return calloc_block(nmemb, size);
+}
+
+static inline void *memalign_site(size_t alignment, size_t size, void *site) {
+#ifndef FREESTANDING
+    if (heap_init() && mymalloc_debug) {
+        if (alignment == 0 || (alignment & (alignment - 1))) {
+            return NULL;
+        }
+        return debug_alloc(size, alignment > ALIGNMENT ? alignment : ALIGNMENT, site);
+    }
+#endif
+    (void)site;
+    return memalign_block(alignment, size);
+}
+
+void *mymalloc_at(size_t size, void *site) {
+    if (sample_due(size)) {
+        return take_sample(malloc_site(size, site), size, site);
+    }
+    return malloc_site(size, site);
+}
+
+void myfree_at(void *ptr, void *site) {
+#ifndef FREESTANDING
+    if (mymalloc_debug && ptr) {
+        debug_free(ptr, site);
+        return;
+    }
+#endif
+    (void)site;
+    free_block(ptr);
+}
+
+// A failed realloc leaves ptr live, but no longer sampled.
+void *myrealloc_at(void *ptr, size_t size, void *site) {
+    if (ptr) {
+        profile_unsample(ptr);
+    }
+    if (sample_due(size)) {
+        return take_sample(realloc_site(ptr, size, site), size, site);
+    }
+    return realloc_site(ptr, size, site);
+}
+
+void *mycalloc_at(size_t nmemb, size_t size, void *site) {
+    if (sample_due(nmemb * size)) {
+        return take_sample(calloc_site(nmemb, size, site), nmemb * size, site);
+    }
+    return calloc_site(nmemb, size, site);
+}
+
+void *mymemalign_at(size_t alignment, size_t size, void *site) {
+    if (sample_due(size)) {
+        return take_sample(memalign_site(alignment, size, site), size, site);
+    }
+    return memalign_site(alignment, size, site);
+}
+
+void *mymalloc(size_t size) {
+    return mymalloc_at(size, __builtin_return_address(0));
+}
+
+void myfree(void *ptr) {
+    myfree_at(ptr, __builtin_return_address(0));
+}
+
+void *myrealloc(void *ptr, size_t size) {
+    return myrealloc_at(ptr, size, __builtin_return_address(0));
+}
+
+void *mycalloc(size_t nmemb, size_t size) {
+    return mycalloc_at(nmemb, size, __builtin_return_address(0));
+}
+
+void *mymemalign(size_t alignment, size_t size) {
+    return mymemalign_at(alignment, size, __builtin_return_address(0));
+}
+
+// Usable bytes behind a live allocation, or 0 if ptr is not one.
+size_t mymalloc_usable_size(void *ptr) {
+#ifndef FREESTANDING
+    if (mymalloc_debug && ptr) {
+        debug_header *hdr = debug_live(ptr);
+        return hdr ? hdr->size : 0;
+    }
+#endif
+    return usable_size(ptr);
+}
+
+// Largest run heap_bulk() carves in one piece, so that a big batch does not
+// map an oversized chunk.
+#define BULK_RUN_BYTES (CHUNK_SIZE / 4)
+
+// Fill ptrs with up to n objects of class c: from the thread cache, then
+// whole batches off the central list, then from our heap's slabs under a
+// single lock.
+static size_t small_bulk(int c, size_t n, void **ptrs) {
+    size_t got = 0;
+#ifndef FREESTANDING
+    // An exited thread's cache stays empty
+    if (tcache.registered > 0) {
+        if ((size_t)tcache.count[c] < n) {
+            tcache_reclaim();
+        }
+        while (got < n && tcache.bins[c]) {
+            void *obj = tcache.bins[c];
+            tcache.bins[c] = *(void **)obj;
+            tcache.count[c]--;
+            tcache.bytes -= class_size[c];
+            ptrs[got++] = obj;
+        }
+        while (got < n) {
+            void *obj = tagged_pop(&central[c], CENTRAL_LINK);
+            if (!obj) {
+                break;
+            }
+            // Whatever the batch has beyond n goes into the cache
+            while (obj) {
+                void *next = *(void **)obj;
+                if (got < n) {
+                    claim_obj(obj);
+                    ptrs[got++] = obj;
+                } else {
+                    tcache_put(c, obj);
+                }
+                obj = next;
+            }
+        }
+    }
+#endif
+    if (got < n) {
+        heap *h = my_heap();
+        lock_heap(h);
+        while (got < n) {
+            void *obj = slab_alloc(h, c);
+            if (!obj) {
+                break;
+            }
+#ifndef FREESTANDING
+            claim_obj(obj);
+#endif
+            ptrs[got++] = obj;
+        }
+        unlock_heap(h);
+    }
+    for (size_t i = 0; i < got; i++) {
+        OBJ_HEADER(ptrs[i]) |= TAG_IN_USE;
+    }
+    stat_add(&STATS->class_allocs[c], got);
+    stat_add(&STATS->bytes_in_use, got * class_size[c]);
+    return got;
+}
+
+// Fill ptrs with up to n heap blocks for size-byte payloads. Each run of
+// blocks is carved from h as one block and then cut up with boundary tags,
+// so the blocks are contiguous; the last one keeps any slack. Caller holds
+// h->lock.
+static size_t heap_bulk(heap *h, size_t size, size_t n, void **ptrs) {
+    size_t need = block_need(size), got = 0;
+    size_t run = BULK_RUN_BYTES / need ? BULK_RUN_BYTES / need : 1;
+    long bytes = 0;
+    while (got < n) {
+        size_t k = n - got < run ? n - got : run;
+        char *addr = find_address(h, k * need - BLOCK_OVERHEAD);
+        if (!addr) {
+            // No room for the whole run: try shorter ones
+            if (k == 1) {
+                break;
+            }
+            run = k / 2;
+            continue;
+        }
+        freeBlock *block = (freeBlock *)(addr - sizeof(size_t));
+        size_t total = block_size(block);
+        for (size_t i = 0; i < k; i++) {
+            size_t bs = i + 1 < k ? need : total - (k - 1) * need;
+            set_block(block, bs, TAG_IN_USE);
+            ptrs[got++] = (char *)block + sizeof(size_t);
+            bytes += bs - BLOCK_OVERHEAD;
+            block = (freeBlock *)((char *)block + bs);
+        }
+    }
+    stat_add(&STATS->bytes_in_use, bytes);
+    return got;
+}
+
+// Allocate n blocks of size bytes into ptrs. Small sizes come from the
+// thread cache or the slabs, medium ones are carved in contiguous runs, and
+// either way at most one heap lock is taken; large ones are mapped one by
+// one. Returns how many were allocated, fewer than n only when memory runs
+// out; the rest of ptrs is left alone.
+static size_t alloc_bulk(size_t size, size_t n, void **ptrs, void *site) {
+    size_t got = 0;
+    heap_init();
+#ifndef FREESTANDING
+    if (mymalloc_debug) {
+        while (got < n && (ptrs[got] = debug_alloc(size, ALIGNMENT, site))) {
+            got++;
+        }
+        return got;
+    }
+    if (!tcache.registered) {
+        tcache_register();
+    }
+    count_malloc(n);
+#else
+    atomic_fetch_add(&malloc_count, n);
+#endif
+    if (n == 0 || size == 0 ||
+        size > heap_limit || size > SIZE_MAX - sizeof(freeBlock) - PAGE_SIZE) {
+        return 0;
+    }
+    size = (size + 7) & ~7;
+
+    if (size <= SMALL_MAX) {
+        got = small_bulk(size_to_class[size / 8], n, ptrs);
+    } else if (size < large_threshold) {
+        heap *h = my_heap();
+        lock_heap(h);
+        got = heap_bulk(h, size, n, ptrs);
+        unlock_heap(h);
+    }
+    stat_add(&STATS->nr_malloc, got);
+    // Large blocks, and whatever the fast paths could not provide
+    while (got < n && (ptrs[got] = place_block(size))) {
+        got++;
+    }
+    (void)site;
+    return got;
+}
+
+size_t mymalloc_bulk(size_t size, size_t n, void **ptrs) {
+    void *site = __builtin_return_address(0);
+    size_t got = alloc_bulk(size, n, ptrs, site);
+    for (size_t i = 0; i < got; i++) {
+        if (sample_due(size)) {
+            take_sample(ptrs[i], size, site);
+        }
+    }
+    return got;
+}
+
+// Free n blocks, skipping NULL entries. Heap blocks are released under one
+// lock as long as they come from the same heap; small objects go through the
+// thread cache without any.
+void myfree_bulk(void **ptrs, size_t n) {
+#ifndef FREESTANDING
+    if (mymalloc_debug) {
+        void *site = __builtin_return_address(0);
+        for (size_t i = 0; i < n; i++) {
+            myfree_at(ptrs[i], site);
+        }
+        return;
+    }
+    if (!tcache.registered) {
+        tcache_register();
+    }
+#endif
+    heap *locked = NULL;
+    long frees = 0, bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+        if (!ptr || !in_heap(ptr)) {
+            continue;
+        }
+        if (OBJ_HEADER(ptr) & (TAG_SLAB | TAG_LARGE)) {
+            // These may take heap locks of their own
+            if (locked) {
+                unlock_heap(locked);
+                locked = NULL;
+            }
+            free_block(ptr);
+            continue;
+        }
+        freeBlock *block = (freeBlock *)((char *)ptr - sizeof(size_t));
+        if (!is_valid_block(block) || !(block->size & TAG_IN_USE)) {
+            continue;
+        }
+        chunk *c = find_chunk(block);
+#ifndef FREESTANDING
+        if (atomic_load_explicit(&c->sampled, memory_order_relaxed)) {
+            profile_forget(ptr);  // takes no heap lock
+        }
+#endif
+        frees++;
+        bytes += block_size(block) - BLOCK_OVERHEAD;
+        heap *h = c->heap;
+        if (h != locked) {
+            if (locked) {
+                unlock_heap(locked);
+            }
+            lock_heap(h);
+            locked = h;
+        }
+        release_block(h, block);
+    }
+    if (locked) {
+        unlock_heap(locked);
+    }
+    stat_add(&STATS->nr_free, frees);
+    stat_add(&STATS->bytes_in_use, -bytes);
+}
+
+// Return a block to h's free list, merging it with free neighbours found
+// through the boundary tags. Caller holds h->lock.
+void release_block(heap *h, freeBlock *block) {
+    set_block(block, block_size(block), 0);
+
+    // The footer of the block to the left sits just before our header
+    size_t left = ((size_t *)block)[-1];
+    if (!(left & TAG_IN_USE)) {
+        freeBlock *prev = (freeBlock *)((char *)block - (left & ~TAG_MASK));
+        remove_from_free_list(h, prev);
+        block = merge_blocks(prev, block);
+    }
+
+    freeBlock *next = (freeBlock *)((char *)block + block_size(block));
+    if (!(next->size & TAG_IN_USE)) {
+        remove_from_free_list(h, next);
+        block = merge_blocks(block, next);
+    }
+
+    insert_into_free_list(h, block);
+#ifndef FREESTANDING
+    long now = now_ms();
+    block->freed_at = now;
+    if (purge_interval_ms > 0 && now - h->last_purge >= purge_interval_ms) {
+        h->last_purge = now;
+        purge_free_spans(h, now - purge_interval_ms);
+    }
+#endif
+    try_release_chunk(h, block);
+}
+
+int is_valid_block(freeBlock *block){
+    // Basic validation: check if block pointer is reasonable
+    if (!block) return 0;
+    
+    // Check if block lies in one of our chunks
+    chunk *c = find_chunk(block);
+    if (!c) return 0;
+    
+    uintptr_t block_addr = (uintptr_t)block;
+    uintptr_t chunk_start_addr = (uintptr_t)chunk_first_block(c);
+    uintptr_t chunk_end_addr = (uintptr_t)c + c->size - sizeof(size_t);
+    
+    // Check if block is within chunk bounds
+    if (block_addr < chunk_start_addr || block_addr >= chunk_end_addr) return 0;
+    
+    // Check alignment
+    if ((block_addr + sizeof(size_t)) % ALIGNMENT != 0) return 0;
+    
+    // Check if block size is reasonable (not too small, not too large)
+    size_t size = block_size(block);
+    if (size < MIN_BLOCK || size > chunk_end_addr - block_addr) return 0;
+    
+    // Header and footer must agree
+    if (((size_t *)(block_addr + size))[-1] != block->size) return 0;
+    
+    return 1;
+}
+
+freeBlock *merge_blocks(freeBlock *block, freeBlock *next) {
+    set_block(block, block_size(block) + block_size(next), 0);
+    return block;
+}
+
+void insert_into_free_list(heap *h, freeBlock *block) {
+    block->prev = NULL;
+    block->next = h->free_list;
+    if (h->free_list) {
+        h->free_list->prev = block;
+    }
+    h->free_list = block;
+}
+
+void remove_from_free_list(heap *h, freeBlock *block) {
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        h->free_list = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+}
+
+static void add_stats(struct thread_stats *to, struct thread_stats *from) {
+    stat_add(&to->nr_malloc, atomic_load_explicit(&from->nr_malloc, memory_order_relaxed));
+    stat_add(&to->nr_free, atomic_load_explicit(&from->nr_free, memory_order_relaxed));
+    stat_add(&to->bytes_in_use, atomic_load_explicit(&from->bytes_in_use, memory_order_relaxed));
+    stat_add(&to->lock_spins, atomic_load_explicit(&from->lock_spins, memory_order_relaxed));
+    stat_add(&to->heap_steals, atomic_load_explicit(&from->heap_steals, memory_order_relaxed));
+    for (int c = 0; c < NR_CLASSES; c++) {
+        stat_add(&to->class_allocs[c], atomic_load_explicit(&from->class_allocs[c], memory_order_relaxed));
+        stat_add(&to->class_frees[c], atomic_load_explicit(&from->class_frees[c], memory_order_relaxed));
+    }
+}
+
+#ifndef FREESTANDING
+// Fold an exiting thread's counters into retired_stats, and zero them so
+// that nothing can count them twice.
+static void retire_stats(struct thread_stats *st) {
+    spin_lock(&stats_lock);
+    struct thread_stats **p = &stats_list;
+    while (*p && *p != st) {
+        p = &(*p)->next;
+    }
+    if (*p) {
+        *p = st->next;
+    }
+    add_stats(&retired_stats, st);
+    spin_unlock(&stats_lock);
+    memset(st, 0, sizeof(*st));
+}
+#endif
+
+void mymalloc_stats(struct mymalloc_stats *stats) {
+    struct thread_stats sum = {0};
+
+    spin_lock(&stats_lock);
+    add_stats(&sum, &retired_stats);
+    for (struct thread_stats *st = stats_list; st; st = st->next) {
+        add_stats(&sum, st);
+    }
+#ifdef FREESTANDING
+    add_stats(&sum, &global_stats);
+#endif
+    spin_unlock(&stats_lock);
+
+    stats->nr_malloc = sum.nr_malloc;
+    stats->nr_free = sum.nr_free;
+    stats->bytes_in_use = sum.bytes_in_use;
+    stats->lock_spins = sum.lock_spins;
+    stats->heap_steals = sum.heap_steals;
+    stats->debug_errors = atomic_load(&debug_errors);
+    for (int c = 0; c < NR_CLASSES; c++) {
+        stats->class_size[c] = class_size[c];
+        stats->class_allocs[c] = sum.class_allocs[c];
+        stats->class_in_use[c] = sum.class_allocs[c] - sum.class_frees[c];
+    }
+
+    // The heaps themselves are only walked here, one lock at a time
+    stats->bytes_mapped = atomic_load(&heap_mapped);
+    stats->bytes_free = 0;
+    stats->largest_free = 0;
+    stats->bytes_purged = 0;
+    for (int i = 0; i < NR_HEAPS; i++) {
+        lock_heap(&heaps[i]);
+        for (freeBlock *b = heaps[i].free_list; b; b = b->next) {
+            stats->bytes_free += block_size(b);
+            if (b->freed_at == 0) {
+                stats->bytes_purged += block_size(b);
+            }
+            if (block_size(b) > stats->largest_free) {
+                stats->largest_free = block_size(b);
+            }
+        }
+        unlock_heap(&heaps[i]);
+    }
+    stats->fragmentation = stats->bytes_free ?
+        1.0 - (double)stats->largest_free / stats->bytes_free : 0.0;
+}
+
+#ifndef FREESTANDING
+void mymalloc_stats_print(void) {
+    struct mymalloc_stats st;
+    mymalloc_stats(&st);
+
+    printf("mymalloc stats:\n");
+    printf("  In use:        %ld bytes\n", st.bytes_in_use);
+    printf("  Mapped:        %zu bytes\n", st.bytes_mapped);
+    printf("  Free (heap):   %zu bytes, largest %zu\n", st.bytes_free, st.largest_free);
+    printf("  Purged:        %zu bytes\n", st.bytes_purged);
+    printf("  Fragmentation: %.3f\n", st.fragmentation);
+    printf("  Allocs/frees:  %ld / %ld\n", st.nr_malloc, st.nr_free);
+    printf("  Lock spins:    %ld\n", st.lock_spins);
+    printf("  Heap steals:   %ld\n", st.heap_steals);
+    printf("  Debug errors:  %ld\n", st.debug_errors);
+    printf("  %6s %10s %10s\n", "class", "allocs", "in use");
+    for (int c = 0; c < MYMALLOC_NR_CLASSES; c++) {
+        if (st.class_allocs[c]) {
+            printf("  %6zu %10ld %10ld\n", st.class_size[c], st.class_allocs[c],
+                   st.class_in_use[c]);
+        }
+    }
+}
+#endif
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+// First usable byte of an arena chunk; the first one also holds the arena.
+// Objects are ALIGNMENT-aligned like everything else mymalloc hands out.
+static char *arena_chunk_start(mymalloc_arena *arena, chunk *c) {
+    char *start = (char *)c + CHUNK_HEADER;
+    return c == arena->first ? start + ALIGN_UP(sizeof(mymalloc_arena)) : start;
+}
+
+mymalloc_arena *mymalloc_arena_create(void) {
+    chunk *c = map_pages(ARENA_CHUNK_SIZE);
+    if (!c) {
+        return NULL;
+    }
+    c->size = ARENA_CHUNK_SIZE;
+    c->prev = c->next = NULL;
+
+    mymalloc_arena *arena = (mymalloc_arena *)((char *)c + CHUNK_HEADER);
+    arena->first = arena->cur = c;
+    arena->top = arena_chunk_start(arena, c);
+    arena->end = (char *)c + c->size;
+    return arena;
+}
+
+void *mymalloc_arena_alloc(mymalloc_arena *arena, size_t size) {
+    if (!arena || size == 0 || size > SIZE_MAX - CHUNK_HEADER - 2 * PAGE_SIZE) {
+        return NULL;
+    }
+    size = ALIGN_UP(size);
+    if (size <= (size_t)(arena->end - arena->top)) {
+        void *ptr = arena->top;
+        arena->top += size;
+        return ptr;
+    }
+
+    // Move on to a chunk kept from before the last reset, if one fits
+    chunk *c = arena->cur;
+    while (c->next && size > c->next->size - CHUNK_HEADER) {
+        c = c->next;
+    }
+    if (c->next) {
+        c = c->next;
+    } else {
+        size_t bytes = ARENA_CHUNK_SIZE;
+        if (size > bytes - CHUNK_HEADER) {
+            bytes = (CHUNK_HEADER + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+        }
+        chunk *fresh = map_pages(bytes);
+        if (!fresh) {
+            return NULL;
+        }
+        fresh->size = bytes;
+        fresh->prev = c;
+        fresh->next = NULL;
+        c->next = fresh;
+        c = fresh;
+    }
+
+    arena->cur = c;
+    arena->top = arena_chunk_start(arena, c) + size;
+    arena->end = (char *)c + c->size;
+    return arena->top - size;
+}
+
+void mymalloc_arena_reset(mymalloc_arena *arena) {
+    if (!arena) {
+        return;
+    }
+    arena->cur = arena->first;
+    arena->top = arena_chunk_start(arena, arena->first);
+    arena->end = (char *)arena->first + arena->first->size;
+}
+
+void mymalloc_arena_destroy(mymalloc_arena *arena) {
+    if (!arena) {
+        return;
+    }
+    // Unmap the first chunk last: the arena itself lives in it
+    chunk *first = arena->first;
+    chunk *c = first->next;
+    while (c) {
+        chunk *next = c->next;
+        unmap_pages(c, c->size);
+        c = next;
     }
+    unmap_pages(first, first->size);
 }
@@ -1,33 +1,319 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdatomic.h>
+#ifndef FREESTANDING
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 typedef struct {
     atomic_int status;
 } spinlock_t;
 
+// A heap block. `size` is the header word (block size plus tag bits) and is
+// repeated in a footer word at the end of the block; prev/next are only
+// meaningful while the block sits in the free list.
 typedef struct freeBlock{
+    size_t size;
     struct freeBlock *prev;
     struct freeBlock *next;
-    size_t size;
+    long freed_at;  // ms timestamp; 0 once its pages went back to the kernel
 } freeBlock;
 
-#define LOCKED   1
-#define UNLOCKED 0
+// A region of mapped pages. Heap blocks are laid out between an
+// in-use prologue and epilogue word, so coalescing never leaves the chunk.
+typedef struct chunk {
+    struct chunk *prev;
+    struct chunk *next;
+    size_t size;  // whole region, header included
+    void *payload;  // large mappings: the pointer handed out
+    size_t registered;  // large mappings: bytes from the start in the page map
+    struct heap *heap;  // heap chunks: the heap whose blocks live here
+    int keep_mapped;  // has held slabs; see tagged_stack
+    atomic_int sampled;  // live heap or large blocks in the heap profile
+} chunk;
 
-static inline void spin_lock(spinlock_t *lock) {
-    int expected;
-    do {
+// Small objects freed by a thread other than the one whose cache they came
+// from. Any thread pushes with one CAS; the owning thread takes the whole
+// list at once. Lists outlive their threads and are reused by new ones.
+typedef struct remote_free {
+    _Atomic(void *) head;      // REMOTE_CLOSED once the owner has exited
+    struct remote_free *next;  // in the pool of unowned lists
+} remote_free;
+
+// A page-sized run of equal-sized objects for one small size class. It is
+// carved out of the heap as an ordinary block; every object is preceded by
+// a one-word header holding the slab address plus OBJ_* tag bits.
+typedef struct slab {
+    uint32_t magic;
+    int cls;
+    int nr_objs;
+    int nr_free;
+    void *free;
+    struct slab *prev;
+    struct slab *next;
+    _Atomic(remote_free *) owner;  // cache that last took objects from it
+    atomic_int sampled;  // live objects in the heap profile
+} slab;
+
+#define LOCKED    1
+#define UNLOCKED  0
+#define CONTENDED 2  // locked, and someone may be asleep on the futex
+
+// Spin with exponential backoff (in pause instructions, capped at
+// SPIN_BACKOFF_MAX); hosted builds give up after SPIN_PARK_AFTER rounds
+// and sleep on a futex instead of burning the core.
+#define SPIN_BACKOFF_MAX 16
+#define SPIN_PARK_AFTER  50
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+#ifndef FREESTANDING
+// Drepper's futex mutex: mark the lock contended, sleep until woken.
+static inline int futex_lock(spinlock_t *lock) {
+    int sleeps = 0;
+    while (atomic_exchange_explicit(&lock->status, CONTENDED,
+                                    memory_order_acquire) != UNLOCKED) {
+        syscall(SYS_futex, &lock->status, FUTEX_WAIT_PRIVATE, CONTENDED, NULL, NULL, 0);
+        sleeps++;
+    }
+    return sleeps;
+}
+#endif
+
+// Returns the number of backoff rounds (and futex sleeps) it took, for
+// contention statistics.
+static inline int spin_lock(spinlock_t *lock) {
+    int expected = UNLOCKED;
+    int spins = 0, backoff = 1;
+    while (!atomic_compare_exchange_weak_explicit(&lock->status, &expected, LOCKED,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed)) {
+        // Test-and-test-and-set: wait on plain loads until it looks free
+        do {
+            for (int i = 0; i < backoff; i++) {
+                cpu_relax();
+            }
+            if (backoff < SPIN_BACKOFF_MAX) {
+                backoff <<= 1;
+            }
+            spins++;
+#ifndef FREESTANDING
+            if (spins >= SPIN_PARK_AFTER) {
+                return spins + futex_lock(lock);
+            }
+#endif
+        } while (atomic_load_explicit(&lock->status, memory_order_relaxed) != UNLOCKED);
         expected = UNLOCKED;
-    } while (!atomic_compare_exchange_strong(&lock->status, &expected, LOCKED));
+    }
+    return spins;
 }
 
 static inline void spin_unlock(spinlock_t *lock) {
+#ifndef FREESTANDING
+    if (atomic_exchange_explicit(&lock->status, UNLOCKED,
+                                 memory_order_release) == CONTENDED) {
+        syscall(SYS_futex, &lock->status, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+#else
     atomic_store_explicit(&lock->status, UNLOCKED, memory_order_release);
+#endif
+}
+
+// A Treiber stack of nodes linked through the pointer `link` bytes into
+// each. The head is paired with a generation that every update bumps, and
+// both are swapped with one 16-byte CAS: a pop whose head was popped and
+// pushed back in the meantime fails instead of installing a stale link
+// (ABA). A pop reads its head's link before the CAS, possibly after another
+// thread took the node, so nodes must stay mapped for as long as any stack
+// might hold them.
+typedef struct {
+    _Alignas(16) void *head;
+    uint32_t gen;
+    uint32_t count;  // nodes on the stack
+} tagged_stack;
+
+#define TAGGED_LINK(node, link) (*(void *volatile *)((char *)(node) + (link)))
+
+static inline int tagged_cas(tagged_stack *s, tagged_stack *expected,
+                             tagged_stack desired) {
+#if defined(__x86_64__)
+    uint64_t lo = (uintptr_t)expected->head;
+    uint64_t hi = expected->gen | (uint64_t)expected->count << 32;
+    char ok;
+    __asm__ __volatile__("lock cmpxchg16b %1\n\tsete %0"
+                         : "=q"(ok), "+m"(*s), "+a"(lo), "+d"(hi)
+                         : "b"((uintptr_t)desired.head),
+                           "c"(desired.gen | (uint64_t)desired.count << 32)
+                         : "memory", "cc");
+    expected->head = (void *)(uintptr_t)lo;
+    expected->gen = (uint32_t)hi;
+    expected->count = hi >> 32;
+    return ok;
+#else
+    // Elsewhere the compiler provides it (possibly through libatomic)
+    return __atomic_compare_exchange(s, expected, &desired, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// A possibly torn snapshot; the CAS that follows catches that.
+static inline tagged_stack tagged_load(tagged_stack *s) {
+    tagged_stack t;
+    t.head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+    t.gen = __atomic_load_n(&s->gen, __ATOMIC_RELAXED);
+    t.count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    return t;
 }
 
+static inline void tagged_push(tagged_stack *s, void *node, size_t link) {
+    tagged_stack old = tagged_load(s), new;
+    do {
+        TAGGED_LINK(node, link) = old.head;
+        new.head = node;
+        new.gen = old.gen + 1;
+        new.count = old.count + 1;
+    } while (!tagged_cas(s, &old, new));
+}
+
+static inline void *tagged_pop(tagged_stack *s, size_t link) {
+    tagged_stack old = tagged_load(s), new;
+    do {
+        if (!old.head) {
+            return NULL;
+        }
+        new.head = TAGGED_LINK(old.head, link);
+        new.gen = old.gen + 1;
+        new.count = old.count - 1;
+    } while (!tagged_cas(s, &old, new));
+    return old.head;
+}
+
+// Detach every node at once; they stay linked.
+static inline void *tagged_take_all(tagged_stack *s) {
+    tagged_stack old = tagged_load(s), new = {NULL, 0, 0};
+    do {
+        if (!old.head) {
+            return NULL;
+        }
+        new.gen = old.gen + 1;
+    } while (!tagged_cas(s, &old, new));
+    return old.head;
+}
+
+#define MYMALLOC_NR_CLASSES 22
+
+// One of several independent heaps. Each has its own lock, free list,
+// chunks and slabs; a block always goes back to the heap of its chunk.
+typedef struct heap {
+    _Alignas(64) spinlock_t lock;
+    freeBlock *free_list;
+    chunk *chunks;
+    int nr_chunks;
+    long last_purge;  // ms timestamp of the last decay pass
+    slab *partial_slabs[MYMALLOC_NR_CLASSES];  // slabs with free objects
+} heap;
+
+// Allocator statistics. Counters are kept per thread and summed when read.
+struct mymalloc_stats {
+    long bytes_in_use;     // usable bytes of live allocations
+    size_t bytes_mapped;   // heap chunks plus large mappings
+    size_t bytes_free;     // bytes in the heap free list
+    size_t largest_free;   // largest block in the heap free list
+    size_t bytes_purged;   // free blocks whose pages are back with the kernel
+    double fragmentation;  // 1 - largest_free / bytes_free
+    long nr_malloc;        // successful allocations
+    long nr_free;
+    long lock_spins;       // spin_lock() backoff rounds on the heap locks
+    long heap_steals;      // blocks carved from another CPU's heap
+    long debug_errors;     // corruptions reported by the debug mode
+    size_t class_size[MYMALLOC_NR_CLASSES];
+    long class_allocs[MYMALLOC_NR_CLASSES];
+    long class_in_use[MYMALLOC_NR_CLASSES];
+};
+
 void *mymalloc(size_t size);
 void myfree(void *ptr);
+void *myrealloc(void *ptr, size_t size);
+void *mycalloc(size_t nmemb, size_t size);
+void *mymemalign(size_t alignment, size_t size);
+size_t mymalloc_usable_size(void *ptr);
+
+// Allocate n blocks of one size into ptrs, returning how many it managed
+// (all of them unless memory runs out); free n blocks, skipping NULLs.
+// Both take at most one heap lock for a whole batch of small or medium
+// blocks, and medium blocks are carved next to each other.
+size_t mymalloc_bulk(size_t size, size_t n, void **ptrs);
+void myfree_bulk(void **ptrs, size_t n);
+
+// The same, with the call site the debug mode reports given explicitly;
+// for wrappers such as the LD_PRELOAD shim.
+void *mymalloc_at(size_t size, void *site);
+void myfree_at(void *ptr, void *site);
+void *myrealloc_at(void *ptr, size_t size, void *site);
+void *mycalloc_at(size_t nmemb, size_t size, void *site);
+void *mymemalign_at(size_t alignment, size_t size, void *site);
+
+// Heap debugging (hosted builds). Set mymalloc_debug before the first
+// allocation, build with -DMYMALLOC_DEBUG=<flags>, or run with e.g.
+// MYMALLOC_DEBUG=canary,guard,quarantine (or "all"); errors are reported on
+// stderr with the call sites involved.
+#define MYMALLOC_DEBUG_CANARY     1  // redzone after each block, checked on free
+#define MYMALLOC_DEBUG_GUARD      2  // large blocks end at an inaccessible page
+#define MYMALLOC_DEBUG_QUARANTINE 4  // poison freed blocks, reuse them late
+#define MYMALLOC_DEBUG_ABORT      8  // abort() after reporting
+
+// Sampling heap profiler (hosted builds). About one allocation per
+// mymalloc_sample_interval bytes (512 KiB; MYMALLOC_SAMPLE=<bytes>, 0 to
+// turn it off) has its backtrace kept for as long as it stays live.
+// MYMALLOC_PROFILE=<file> dumps them at exit.
+#define MYMALLOC_PROFILE_PPROF  0  // heap profile for `pprof <program> <file>`
+#define MYMALLOC_PROFILE_FOLDED 1  // folded stacks for flamegraph.pl
+int mymalloc_profile_dump(int fd, int format);
+
+size_t mymalloc_purge(void);
+void mymalloc_stats(struct mymalloc_stats *stats);
+void mymalloc_stats_print(void);
+
+// A bump-pointer arena for objects that die together. Memory comes from its
+// own list of page-mapped chunks, never from the shared heap, so an arena
+// takes no locks and must only be used by one thread at a time. reset()
+// rewinds to the first chunk in O(1) and keeps the chunks for reuse;
+// destroy() unmaps them all.
+typedef struct mymalloc_arena {
+    chunk *first;  // chunk list; this struct lives at the start of `first`
+    chunk *cur;    // chunk being carved
+    char *top;     // next free byte in `cur`
+    char *end;     // end of `cur`
+} mymalloc_arena;
+
+mymalloc_arena *mymalloc_arena_create(void);
+void *mymalloc_arena_alloc(mymalloc_arena *arena, size_t size);
+void mymalloc_arena_reset(mymalloc_arena *arena);
+void mymalloc_arena_destroy(mymalloc_arena *arena);
+
+#ifdef FREESTANDING
+// Where a freestanding build gets its memory. The runtime installs a
+// provider before the first allocation. alloc() returns `length` bytes
+// (a multiple of 4096) that are page-aligned and read as zeros, or NULL
+// when it is out of memory; free() takes back a range alloc() returned, and
+// may be NULL if pages are never given back. Hosted builds use vmalloc().
+typedef struct mymalloc_page_provider {
+    void *(*alloc)(size_t length);
+    void (*free)(void *addr, size_t length);
+} mymalloc_page_provider;
+
+void mymalloc_set_page_provider(const mymalloc_page_provider *provider);
+#endif
 
 void *vmalloc(void *addr, size_t length);
 void vmfree(void *addr, size_t length);
+void vmpurge(void *addr, size_t length);
+void vmguard(void *addr, size_t length);
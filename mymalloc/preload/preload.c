@@ -0,0 +1,93 @@
+// LD_PRELOAD shim: the libc allocation entry points on top of mymalloc.
+//
+//   make libmymalloc.so
+//   LD_PRELOAD=$PWD/libmymalloc.so ./program
+//
+// mymalloc never calls back into libc's allocator, so the first malloc()
+// from the dynamic loader needs no bootstrap beyond heap_init()'s own
+// locking. The library is built with -ftls-model=initial-exec so the
+// thread cache is reached without __tls_get_addr, which may allocate.
+//
+// Pointers are 16-byte aligned, alignof(max_align_t), as everywhere in
+// mymalloc; code that needs more asks through posix_memalign() and friends.
+//
+// Everything goes through the *_at() entry points so that the debug mode
+// (MYMALLOC_DEBUG=...) reports the program's call sites, not the shim's.
+
+#ifndef FREESTANDING
+
+#include <errno.h>
+#include <mymalloc.h>
+
+#define CALLER __builtin_return_address(0)
+
+// mymalloc() returns NULL for 0 bytes; libc callers expect a unique pointer.
+void *malloc(size_t size) {
+    void *ptr = mymalloc_at(size ? size : 1, CALLER);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    myfree_at(ptr, CALLER);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *ptr = nmemb && size ? mycalloc_at(nmemb, size, CALLER) : mycalloc_at(1, 1, CALLER);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr && size == 0) {
+        myfree_at(ptr, CALLER);
+        return NULL;
+    }
+    void *fresh = myrealloc_at(ptr, size ? size : 1, CALLER);
+    if (!fresh) {
+        errno = ENOMEM;
+    }
+    return fresh;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void *ptr = mymemalign_at(alignment, size ? size : 1, CALLER);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+static void *aligned(size_t alignment, size_t size, void *site) {
+    void *ptr = mymemalign_at(alignment, size ? size : 1, site);
+    if (!ptr) {
+        errno = alignment && !(alignment & (alignment - 1)) ? ENOMEM : EINVAL;
+    }
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned(alignment, size, CALLER);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return aligned(alignment, size, CALLER);
+}
+
+void *valloc(size_t size) {
+    return aligned(4096, size, CALLER);
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mymalloc_usable_size(ptr);
+}
+
+#endif
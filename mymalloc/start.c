@@ -5,10 +5,26 @@
 // This checks whether your code works for
 // freestanding environments.
 
+// A stand-in for the runtime's page allocator: bump through a reserved
+// region and never take anything back.
+static char pages[4 << 20] __attribute__((aligned(4096)));
+static size_t pages_used;
+
+static void *page_alloc(size_t length) {
+    if (length > sizeof(pages) - pages_used) {
+        return NULL;
+    }
+    pages_used += length;
+    return pages + pages_used - length;
+}
+
 void _start() {
 }
 
 int main() {
+    mymalloc_page_provider provider = {page_alloc, NULL};
+    mymalloc_set_page_provider(&provider);
+    myfree(mymalloc(64));
     return 0;
 }
 
@@ -30,4 +46,14 @@ void vmfree(void *addr, size_t length) {
     munmap(addr, length);
 }
 
+// Drop the pages' contents but keep the mapping; they read back as zeros.
+void vmpurge(void *addr, size_t length) {
+    madvise(addr, length, MADV_DONTNEED);
+}
+
+// Make the pages inaccessible; any access faults.
+void vmguard(void *addr, size_t length) {
+    mprotect(addr, length, PROT_NONE);
+}
+
 #endif
@@ -91,6 +91,92 @@ SystemTest(benchmark_batch_alloc_free, ((const char *[]){})) {
     #endif
 }
 
+// 测试2b: 同样的批量模式，改用 arena 分配并一次性 reset
+SystemTest(benchmark_arena_alloc_reset, ((const char *[]){})) {
+    const int batch_size = 1000;
+    const int rounds = 100;
+    void *ptrs[batch_size];
+
+    // 对照组：逐个 myfree
+    long long start_time = get_time_us();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < batch_size; i++) {
+            ptrs[i] = mymalloc(16 + (i % 112));
+        }
+        for (int i = 0; i < batch_size; i++) {
+            myfree(ptrs[i]);
+        }
+    }
+    long long heap_duration = get_time_us() - start_time;
+
+    mymalloc_arena *arena = mymalloc_arena_create();
+    tk_assert(arena != NULL, "arena creation should succeed");
+    start_time = get_time_us();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < batch_size; i++) {
+            ptrs[i] = mymalloc_arena_alloc(arena, 16 + (i % 112));
+        }
+        mymalloc_arena_reset(arena);
+    }
+    long long arena_duration = get_time_us() - start_time;
+    mymalloc_arena_destroy(arena);
+
+    tk_assert(arena_duration < 500000, "arena alloc/reset should complete within 0.5 seconds");
+
+    #ifndef FREESTANDING
+    if (getenv("TK_VERBOSE")) {
+        printf("Batch %d x %d: mymalloc/myfree %lld us, arena alloc/reset %lld us\n",
+               rounds, batch_size, heap_duration, arena_duration);
+    }
+    #endif
+}
+
+// 测试2c: 逐步增长的缓冲区，myrealloc 原地扩展 vs 手动分配+拷贝+释放
+SystemTest(benchmark_realloc_growth, ((const char *[]){})) {
+    const int rounds = 200;
+    const size_t max_size = 64 * 1024;
+
+    long long start_time = get_time_us();
+    for (int r = 0; r < rounds; r++) {
+        char *buf = NULL;
+        for (size_t size = 64; size <= max_size; size += 256) {
+            buf = myrealloc(buf, size);
+            tk_assert(buf != NULL, "realloc should succeed");
+            buf[size - 1] = 1;
+        }
+        myfree(buf);
+    }
+    long long realloc_duration = get_time_us() - start_time;
+
+    start_time = get_time_us();
+    for (int r = 0; r < rounds; r++) {
+        char *buf = NULL;
+        size_t old = 0;
+        for (size_t size = 64; size <= max_size; size += 256) {
+            char *fresh = mymalloc(size);
+            tk_assert(fresh != NULL, "malloc should succeed");
+            if (buf) {
+                memcpy(fresh, buf, old);
+                myfree(buf);
+            }
+            buf = fresh;
+            old = size;
+            buf[size - 1] = 1;
+        }
+        myfree(buf);
+    }
+    long long copy_duration = get_time_us() - start_time;
+
+    tk_assert(realloc_duration < 2000000, "realloc growth should complete within 2 seconds");
+
+    #ifndef FREESTANDING
+    if (getenv("TK_VERBOSE")) {
+        printf("Buffer growth to %zu bytes x %d: myrealloc %lld us, copy %lld us\n",
+               max_size, rounds, realloc_duration, copy_duration);
+    }
+    #endif
+}
+
 // 测试3: 随机大小分配（模拟真实程序的分配模式）
 SystemTest(benchmark_random_sizes, ((const char *[]){})) {
     const int iterations = 5000;
@@ -1,8 +1,10 @@
 // Comprehensive test cases for mymalloc/myfree
 // Tests cover edge cases, concurrent operations, and stress testing
 
+#define _GNU_SOURCE
 #include <testkit.h>
 #include <pthread.h>
+#include <sched.h>
 #include <mymalloc.h>
 #include <stdint.h>
 #include <string.h>
@@ -42,18 +44,34 @@ SystemTest(edge_cases, ((const char *[]){})) {
     myfree(p1);
 }
 
-// Test memory alignment
+// Test memory alignment: every size class, heap blocks and large mappings
+// are aligned to alignof(max_align_t), as libc's malloc() must be
 SystemTest(alignment_check, ((const char *[]){})) {
-    for (int i = 1; i <= 64; i++) {
-        void *ptr = mymalloc(i);
-        tk_assert(ptr != NULL, "allocation should succeed");
-        
-        uintptr_t addr = (uintptr_t)ptr;
-        tk_assert((addr & 7) == 0, "pointer should be 8-byte aligned");
-        
+    void *ptrs[64];
+    for (int i = 1; i <= 2048; i++) {
+        // Several objects per size, so slab slots past the first are checked
+        for (int j = 0; j < 64; j++) {
+            ptrs[j] = mymalloc(i);
+            tk_assert(ptrs[j] != NULL, "allocation should succeed");
+            tk_assert((uintptr_t)ptrs[j] % 16 == 0, "pointer should be 16-byte aligned");
+        }
         // Write to the memory to ensure it's accessible
-        memset(ptr, 0xAA, i);
-        
+        memset(ptrs[0], 0xAA, i);
+
+        void *c = mycalloc(1, i);
+        tk_assert((uintptr_t)c % 16 == 0, "calloc should be 16-byte aligned");
+        c = myrealloc(c, i * 3);
+        tk_assert((uintptr_t)c % 16 == 0, "realloc should be 16-byte aligned");
+        myfree(c);
+        for (int j = 0; j < 64; j++) {
+            myfree(ptrs[j]);
+        }
+    }
+
+    size_t sizes[] = {4000, 50000, 128 * 1024, 300 * 1000};
+    for (int i = 0; i < 4; i++) {
+        void *ptr = mymalloc(sizes[i]);
+        tk_assert((uintptr_t)ptr % 16 == 0, "pointer should be 16-byte aligned");
         myfree(ptr);
     }
 }
@@ -165,6 +183,128 @@ SystemTest(various_sizes, ((const char *[]){})) {
     }
 }
 
+// Test allocations above the large-block threshold (own mapping each)
+SystemTest(large_allocations, ((const char *[]){})) {
+    size_t sizes[] = {128 * 1024, 300 * 1000, 4 * 1024 * 1024};
+    void *ptrs[3];
+
+    for (int i = 0; i < 3; i++) {
+        ptrs[i] = mymalloc(sizes[i]);
+        tk_assert(ptrs[i] != NULL, "large allocation should succeed");
+        tk_assert(((uintptr_t)ptrs[i] & 15) == 0, "pointer should be 16-byte aligned");
+        memset(ptrs[i], i + 1, sizes[i]);
+    }
+
+    // A small block in between must not be disturbed by large frees
+    char *small = mymalloc(32);
+    tk_assert(small != NULL, "small allocation should succeed");
+    memset(small, 0x5A, 32);
+
+    for (int i = 0; i < 3; i++) {
+        unsigned char *data = (unsigned char *)ptrs[i];
+        tk_assert(data[0] == i + 1 && data[sizes[i] - 1] == i + 1,
+                  "large block data should be preserved");
+        myfree(ptrs[i]);
+    }
+    myfree(ptrs[0]);  // double free of an unmapped block must be ignored
+
+    for (int i = 0; i < 32; i++) {
+        tk_assert(small[i] == 0x5A, "small block should be intact");
+    }
+    myfree(small);
+}
+
+// Test myrealloc, mycalloc and mymemalign
+SystemTest(realloc_calloc_memalign, ((const char *[]){})) {
+    // Grow a buffer step by step; contents must follow it
+    unsigned char *buf = myrealloc(NULL, 16);
+    tk_assert(buf != NULL, "realloc(NULL) should allocate");
+    for (int i = 0; i < 16; i++) buf[i] = i;
+    size_t size = 16;
+    while (size < 512 * 1024) {
+        size_t next = size * 2;
+        buf = myrealloc(buf, next);
+        tk_assert(buf != NULL, "realloc should succeed");
+        for (size_t i = 0; i < size; i++) {
+            tk_assert(buf[i] == (unsigned char)i, "realloc should preserve contents");
+        }
+        for (size_t i = size; i < next; i++) buf[i] = (unsigned char)i;
+        size = next;
+    }
+    buf = myrealloc(buf, 100);
+    tk_assert(buf != NULL && buf[99] == 99, "shrinking realloc should keep the prefix");
+    tk_assert(myrealloc(buf, 0) == NULL, "realloc to 0 should free");
+
+    // A heap block followed by free space grows without moving
+    char *a = mymalloc(2000);
+    char *b = mymalloc(2000);
+    myfree(b);
+    tk_assert(myrealloc(a, 3000) == a, "realloc should grow into the free neighbour");
+    myfree(a);
+
+    size_t sizes[] = {24, 1000, 5000, 300 * 1000};
+    for (int i = 0; i < 4; i++) {
+        unsigned char *z = mycalloc(sizes[i] / 8, 8);
+        tk_assert(z != NULL, "calloc should succeed");
+        for (size_t j = 0; j < sizes[i]; j++) {
+            tk_assert(z[j] == 0, "calloc memory should be zero");
+        }
+        memset(z, 0xFF, sizes[i]);
+        myfree(z);
+    }
+    tk_assert(mycalloc(SIZE_MAX / 2, 4) == NULL, "calloc overflow should fail");
+
+    size_t aligns[] = {16, 64, 4096, 65536};
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 3; j++) {
+            size_t n = j == 2 ? 200 * 1000 : 100 + j * 3000;
+            char *p = mymemalign(aligns[i], n);
+            tk_assert(p != NULL, "memalign should succeed");
+            tk_assert(((uintptr_t)p & (aligns[i] - 1)) == 0, "memalign should align");
+            memset(p, 0x77, n);
+            myfree(p);
+        }
+    }
+    tk_assert(mymemalign(48, 64) == NULL, "non-power-of-two alignment should fail");
+}
+
+// Test bump-pointer arenas: many objects, one reset, oversize requests
+SystemTest(arena_allocations, ((const char *[]){})) {
+    mymalloc_arena *arena = mymalloc_arena_create();
+    tk_assert(arena != NULL, "arena creation should succeed");
+
+    char *first = NULL, *prev = NULL;
+    for (int i = 0; i < 10000; i++) {
+        char *p = mymalloc_arena_alloc(arena, 1 + i % 100);
+        tk_assert(p != NULL, "arena allocation should succeed");
+        // Odd sizes too: arena objects are aligned like malloc()'s
+        tk_assert((uintptr_t)p % 16 == 0, "pointer should be 16-byte aligned");
+        tk_assert(p != prev, "arena objects should be distinct");
+        memset(p, i & 0xFF, 1 + i % 100);
+        if (!first) {
+            first = p;
+        }
+        prev = p;
+    }
+    tk_assert(first[0] == 0, "earlier arena objects should be preserved");
+
+    // Bigger than an arena chunk: gets its own mapping
+    char *big = mymalloc_arena_alloc(arena, 1024 * 1024);
+    tk_assert(big != NULL, "oversize arena allocation should succeed");
+    tk_assert((uintptr_t)big % 16 == 0, "pointer should be 16-byte aligned");
+    memset(big, 0x33, 1024 * 1024);
+
+    // Reset hands the same memory out again
+    mymalloc_arena_reset(arena);
+    tk_assert(mymalloc_arena_alloc(arena, 16) == first, "reset should rewind the arena");
+    big = mymalloc_arena_alloc(arena, 1024 * 1024);
+    tk_assert(big != NULL, "allocation after reset should succeed");
+    big[1024 * 1024 - 1] = 1;
+
+    myfree(first);  // not a heap pointer: must be ignored
+    mymalloc_arena_destroy(arena);
+}
+
 // Concurrent allocation test data
 typedef struct {
     int thread_id;
@@ -320,6 +460,10 @@ SystemTest(stress_test, ((const char *[]){})) {
 
 // Test memory exhaustion
 SystemTest(memory_exhaustion, ((const char *[]){})) {
+    // The heap grows on demand; cap it so exhaustion is reachable.
+    extern size_t heap_limit;
+    heap_limit = 512 * 1024;
+
     void *ptrs[1000];
     int count = 0;
     
@@ -345,3 +489,260 @@ SystemTest(memory_exhaustion, ((const char *[]){})) {
     tk_assert(new_ptr != NULL, "should be able to allocate after freeing");
     myfree(new_ptr);
 }
+
+// Memory freed into one thread's heap must stay usable by threads running
+// elsewhere once heap_limit stops their own heaps from growing.
+static pthread_barrier_t limit_barrier;
+
+static void *limit_worker(void *arg) {
+    long id = (long)arg;
+    void *ptrs[200];
+    long got = 0;
+    if (id == 0) {
+        for (int i = 0; i < 200; i++) ptrs[i] = mymalloc(3000);
+        for (int i = 0; i < 200; i++) myfree(ptrs[i]);
+    }
+    pthread_barrier_wait(&limit_barrier);
+    if (id != 0) {
+        for (int i = 0; i < 50; i++) {
+            ptrs[i] = mymalloc(3000);
+            if (ptrs[i]) {
+                memset(ptrs[i], (int)id, 3000);
+                got++;
+            }
+        }
+    }
+    pthread_barrier_wait(&limit_barrier);
+    if (id != 0) {
+        for (int i = 0; i < got; i++) myfree(ptrs[i]);
+    }
+    return (void *)got;
+}
+
+SystemTest(heap_limit_across_threads, ((const char *[]){})) {
+    extern size_t heap_limit;
+    heap_limit = 1024 * 1024;
+    pthread_t threads[4];
+    pthread_barrier_init(&limit_barrier, NULL, 4);
+    for (long i = 0; i < 4; i++) {
+        tk_assert(pthread_create(&threads[i], NULL, limit_worker, (void *)i) == 0,
+                  "thread creation should succeed");
+    }
+    for (int i = 0; i < 4; i++) {
+        void *got;
+        pthread_join(threads[i], &got);
+        tk_assert(i == 0 || (long)got == 50, "allocations should be served from any heap");
+    }
+    pthread_barrier_destroy(&limit_barrier);
+}
+
+// Central free lists: 16 threads pop nodes off one tagged_stack and push
+// them back. A node popped by two threads at once would be caught by its
+// held flag; a lost or duplicated one by the final count.
+#define STACK_NODES   256
+#define STACK_THREADS 16
+
+typedef struct {
+    void *link;
+    atomic_int held;
+} stack_node;
+
+static tagged_stack stress_stack;
+static stack_node stack_nodes[STACK_NODES];
+
+static void *stack_worker(void *arg) {
+    long errors = 0;
+    unsigned seed = (unsigned)(long)arg;
+    for (int i = 0; i < 100000; i++) {
+        stack_node *got[4];
+        int n = 1 + rand_r(&seed) % 4, k = 0;
+        while (k < n && (got[k] = tagged_pop(&stress_stack, 0))) {
+            if (atomic_exchange(&got[k]->held, 1)) {
+                errors++;
+            }
+            k++;
+        }
+        while (k > 0) {
+            atomic_store(&got[--k]->held, 0);
+            tagged_push(&stress_stack, got[k], 0);
+        }
+    }
+    return (void *)errors;
+}
+
+SystemTest(tagged_stack_stress, ((const char *[]){})) {
+    for (int i = 0; i < STACK_NODES; i++) {
+        tagged_push(&stress_stack, &stack_nodes[i], 0);
+    }
+    pthread_t threads[STACK_THREADS];
+    for (long i = 0; i < STACK_THREADS; i++) {
+        tk_assert(pthread_create(&threads[i], NULL, stack_worker, (void *)i) == 0,
+                  "thread creation should succeed");
+    }
+    long errors = 0;
+    for (int i = 0; i < STACK_THREADS; i++) {
+        void *e;
+        pthread_join(threads[i], &e);
+        errors += (long)e;
+    }
+    tk_assert(errors == 0, "no node should be handed out twice");
+    tk_assert(stress_stack.count == STACK_NODES, "count should match the nodes");
+
+    int seen = 0;
+    for (stack_node *n = stress_stack.head; n; n = n->link) {
+        tk_assert(n >= stack_nodes && n < stack_nodes + STACK_NODES, "link should be a node");
+        tk_assert(!atomic_exchange(&n->held, 1), "each node should be on the stack once");
+        seen++;
+    }
+    tk_assert(seen == STACK_NODES, "every node should be back on the stack");
+}
+
+// The same through the allocator: each thread frees more than its cache
+// keeps, so objects keep moving through the central lists. Every live
+// object carries its owner's stamp; a block handed to two threads at once
+// would have it overwritten.
+static void *central_worker(void *arg) {
+    long id = (long)arg, errors = 0;
+    uintptr_t *objs[400];
+    for (int round = 0; round < 200; round++) {
+        size_t size = 16 + 16 * ((round + id) % 8);
+        for (int i = 0; i < 400; i++) {
+            objs[i] = mymalloc(size);
+            if (objs[i]) {
+                objs[i][0] = (uintptr_t)id;
+                objs[i][1] = (uintptr_t)i;
+            }
+        }
+        for (int i = 0; i < 400; i++) {
+            if (objs[i] && (objs[i][0] != (uintptr_t)id || objs[i][1] != (uintptr_t)i)) {
+                errors++;
+            }
+            myfree(objs[i]);
+        }
+    }
+    return (void *)errors;
+}
+
+SystemTest(central_list_stress, ((const char *[]){})) {
+    pthread_t threads[STACK_THREADS];
+    for (long i = 0; i < STACK_THREADS; i++) {
+        tk_assert(pthread_create(&threads[i], NULL, central_worker, (void *)i) == 0,
+                  "thread creation should succeed");
+    }
+    long errors = 0;
+    for (int i = 0; i < STACK_THREADS; i++) {
+        void *e;
+        pthread_join(threads[i], &e);
+        errors += (long)e;
+    }
+    tk_assert(errors == 0, "no object should be live in two threads at once");
+}
+
+// A pthread key created after the allocator's has its destructor run after
+// the thread cache has been handed back. This one re-arms itself until the
+// last destructor round, like glibc's own late frees: a cache built then
+// would never be flushed.
+static pthread_key_t late_key;
+static __thread int late_rounds;
+#define LATE_SIZE 700
+
+static void late_free(void *p) {
+    if (++late_rounds < PTHREAD_DESTRUCTOR_ITERATIONS) {
+        pthread_setspecific(late_key, p);
+        return;
+    }
+    myfree(p);
+    myfree(mymalloc(LATE_SIZE));
+}
+
+static void *late_worker(void *arg) {
+    void *p = mymalloc(LATE_SIZE);
+    *(void **)arg = p;
+    pthread_setspecific(late_key, p);
+    for (int i = 0; i < 100; i++) {
+        myfree(mymalloc(LATE_SIZE));
+    }
+    return NULL;
+}
+
+SystemTest(free_after_thread_exit, ((const char *[]){})) {
+    // One CPU for both threads, so that they share a heap
+    cpu_set_t all, one;
+    pthread_getaffinity_np(pthread_self(), sizeof(all), &all);
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &all)) {
+        cpu++;
+    }
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(one), &one);
+
+    myfree(mymalloc(LATE_SIZE));  // the allocator's key comes first
+    tk_assert(pthread_key_create(&late_key, late_free) == 0, "key creation should succeed");
+    struct mymalloc_stats before, after;
+    mymalloc_stats(&before);
+    void *p = NULL;
+    pthread_t t;
+    tk_assert(pthread_create(&t, &attr, late_worker, &p) == 0, "thread creation should succeed");
+    pthread_join(t, NULL);
+    mymalloc_stats(&after);
+    tk_assert(after.nr_malloc - before.nr_malloc == 102, "late allocations are counted");
+    tk_assert(after.nr_free - before.nr_free == 102, "late frees are counted");
+    tk_assert(after.bytes_in_use == before.bytes_in_use, "nothing is left in use");
+
+    // The block went back to its slab, not into a cache that is gone
+    enum { TRIES = 4096 };
+    static void *ptrs[TRIES];
+    int found = 0, n = 0;
+    while (n < TRIES && !found) {
+        ptrs[n] = mymalloc(LATE_SIZE);
+        found = ptrs[n++] == p;
+    }
+    for (int i = 0; i < n; i++) {
+        myfree(ptrs[i]);
+    }
+    tk_assert(found, "the block freed after exit is reused");
+
+    pthread_key_delete(late_key);
+    pthread_attr_destroy(&attr);
+    pthread_setaffinity_np(pthread_self(), sizeof(all), &all);
+}
+
+// Bulk allocation: every block distinct and usable, medium blocks carved
+// next to each other, and the statistics kept as for single calls.
+SystemTest(bulk_alloc_free, ((const char *[]){})) {
+    enum { N = 300 };
+    static void *ptrs[N];
+    size_t sizes[] = {24, 2048, 200 * 1024};
+    for (int s = 0; s < 3; s++) {
+        struct mymalloc_stats before, after;
+        mymalloc_stats(&before);
+        tk_assert(mymalloc_bulk(sizes[s], N, ptrs) == N, "bulk allocation should fill every slot");
+        for (int i = 0; i < N; i++) {
+            tk_assert(mymalloc_usable_size(ptrs[i]) >= sizes[s], "block should be big enough");
+            memset(ptrs[i], i & 0xff, sizes[s]);
+        }
+        for (int i = 0; i < N; i++) {
+            tk_assert(((unsigned char *)ptrs[i])[0] == (i & 0xff) &&
+                      ((unsigned char *)ptrs[i])[sizes[s] - 1] == (i & 0xff),
+                      "blocks should not overlap");
+        }
+        if (sizes[s] == 2048) {
+            tk_assert((char *)ptrs[1] - (char *)ptrs[0] == 2048 + 2 * sizeof(size_t),
+                      "medium blocks should be contiguous");
+        }
+        mymalloc_stats(&after);
+        tk_assert(after.nr_malloc - before.nr_malloc == N, "nr_malloc should count each block");
+        void *kept = ptrs[N / 2];
+        ptrs[N / 2] = NULL;  // skipped
+        myfree_bulk(ptrs, N);
+        mymalloc_stats(&after);
+        tk_assert(after.nr_free - before.nr_free == N - 1, "nr_free should count each block");
+        tk_assert(mymalloc_usable_size(kept) >= sizes[s], "a skipped block should stay live");
+        myfree(kept);
+    }
+    tk_assert(mymalloc_bulk(0, N, ptrs) == 0, "size 0 should allocate nothing");
+}
@@ -4,7 +4,11 @@
 #include <pthread.h>
 #include <mymalloc.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 // Test for double-free detection (should not crash)
 SystemTest(double_free_safety, ((const char *[]){})) {
@@ -181,6 +185,230 @@ SystemTest(rapid_alloc_free, ((const char *[]){})) {
     tk_assert(1, "rapid allocation/free test completed");
 }
 
+// Test that mymalloc_stats() tracks live allocations
+SystemTest(stats_accounting, ((const char *[]){})) {
+    struct mymalloc_stats before, during, after;
+    mymalloc_stats(&before);
+
+    void *small = mymalloc(100);
+    void *medium = mymalloc(4000);
+    void *large = mymalloc(1 << 20);
+    tk_assert(small && medium && large, "allocations should succeed");
+
+    mymalloc_stats(&during);
+    tk_assert(during.nr_malloc - before.nr_malloc == 3, "three allocations counted");
+    tk_assert(during.bytes_in_use - before.bytes_in_use >= 100 + 4000 + (1 << 20),
+              "bytes in use should cover the requests");
+    tk_assert(during.bytes_mapped >= (size_t)during.bytes_in_use,
+              "mapped bytes should cover bytes in use");
+
+    long class_live = 0;
+    for (int c = 0; c < MYMALLOC_NR_CLASSES; c++) {
+        class_live += during.class_in_use[c] - before.class_in_use[c];
+    }
+    tk_assert(class_live == 1, "one small object should be live");
+
+    myfree(small);
+    myfree(medium);
+    myfree(large);
+
+    mymalloc_stats(&after);
+    tk_assert(after.nr_free - before.nr_free == 3, "three frees counted");
+    tk_assert(after.bytes_in_use == before.bytes_in_use, "bytes in use should drop back");
+    tk_assert(after.largest_free <= after.bytes_free, "largest free block fits in free bytes");
+    tk_assert(after.fragmentation >= 0.0 && after.fragmentation < 1.0,
+              "fragmentation ratio should be in [0, 1)");
+}
+
+// Threads whose last free comes after their cache has been handed back,
+// from a pthread key destructor on its final round. Later threads reuse
+// the exited ones' TLS blocks; every counter must still add up exactly.
+static pthread_key_t exit_key;
+static __thread int exit_rounds;
+
+static void exit_free(void *p) {
+    if (++exit_rounds < PTHREAD_DESTRUCTOR_ITERATIONS) {
+        pthread_setspecific(exit_key, p);
+        return;
+    }
+    myfree(p);
+}
+
+static void *exit_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 1000; i++) {
+        myfree(mymalloc(32));
+    }
+    pthread_setspecific(exit_key, mymalloc(32));
+    return NULL;
+}
+
+SystemTest(stats_after_thread_exit, ((const char *[]){})) {
+    myfree(mymalloc(32));  // the allocator's key comes first
+    tk_assert(pthread_key_create(&exit_key, exit_free) == 0, "key creation should succeed");
+    for (int round = 0; round < 3; round++) {
+        struct mymalloc_stats before, after;
+        mymalloc_stats(&before);
+        pthread_t threads[4];
+        for (int i = 0; i < 4; i++) {
+            tk_assert(pthread_create(&threads[i], NULL, exit_worker, NULL) == 0,
+                      "thread creation should succeed");
+        }
+        for (int i = 0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        mymalloc_stats(&after);
+        tk_assert(after.nr_malloc - before.nr_malloc == 4 * 1001, "each allocation counted once");
+        tk_assert(after.nr_free - before.nr_free == 4 * 1001, "each free counted once");
+        tk_assert(after.bytes_in_use == before.bytes_in_use, "nothing is left in use");
+    }
+    pthread_key_delete(exit_key);
+}
+
+// Debug mode: overflows, double frees and writes after free are reported
+// (on stderr, and counted in the stats) instead of corrupting the heap.
+SystemTest(debug_detects_corruption, ((const char *[]){})) {
+    extern int mymalloc_debug;
+    mymalloc_debug = MYMALLOC_DEBUG_CANARY | MYMALLOC_DEBUG_QUARANTINE;
+    struct mymalloc_stats st;
+
+    char *p = mymalloc(100);
+    tk_assert(p != NULL, "allocation should succeed");
+    tk_assert(mymalloc_usable_size(p) == 100, "usable size is the requested size");
+    memset(p, 'x', 100);
+    myfree(p);
+    mymalloc_stats(&st);
+    tk_assert(st.debug_errors == 0, "a clean free reports nothing");
+
+    p = mymalloc(100);
+    p[100] = 'x';
+    myfree(p);
+    mymalloc_stats(&st);
+    tk_assert(st.debug_errors == 1, "overflow past the block is reported");
+
+    myfree(p);
+    mymalloc_stats(&st);
+    tk_assert(st.debug_errors == 2, "double free is reported");
+
+    // The quarantine keeps the block out of circulation; the write is
+    // found once enough later frees push it out.
+    char *q = mymalloc(64);
+    myfree(q);
+    tk_assert(mymalloc(64) != q, "a freed block is not reused at once");
+    q[10] = 'y';
+    for (int i = 0; i < 5000; i++) {
+        myfree(mymalloc(64));
+    }
+    mymalloc_stats(&st);
+    tk_assert(st.debug_errors == 3, "write after free is reported");
+}
+
+// Debug mode: large blocks end right at an inaccessible page.
+SystemTest(debug_guard_page, ((const char *[]){})) {
+    extern int mymalloc_debug;
+    mymalloc_debug = MYMALLOC_DEBUG_GUARD;
+
+    char *p = mymalloc(200000);
+    tk_assert(p != NULL, "allocation should succeed");
+    memset(p, 1, 200000);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        p[200000] = 1;
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    tk_assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV,
+              "writing past the block faults");
+
+    myfree(p);
+    p = mymalloc(200000);
+    tk_assert(p != NULL, "the mapping is reusable after free");
+    myfree(p);
+
+    // Sizes whose payload starts a page after the debug header
+    static const size_t sizes[] = {135132, 131036, 163810};
+    struct mymalloc_stats st;
+    mymalloc_stats(&st);
+    long errors = st.debug_errors;
+    for (int i = 0; i < 3; i++) {
+        p = mymalloc(sizes[i]);
+        tk_assert(p != NULL, "allocation should succeed");
+        tk_assert(mymalloc_usable_size(p) == sizes[i], "usable size is the requested size");
+        memset(p, 1, sizes[i]);
+        myfree(p);
+    }
+    mymalloc_stats(&st);
+    tk_assert(st.debug_errors == errors, "the frees are not reported");
+}
+
+// Heap profile: the sampled bytes add up to about what is live, and freed
+// blocks drop out of the table.
+static long dump_profile(int format, char *buf, size_t len) {
+    char path[] = "/tmp/mymalloc-profile-XXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    long n = mymalloc_profile_dump(fd, format);
+    size_t got = 0;
+    ssize_t r;
+    lseek(fd, 0, SEEK_SET);
+    while (got < len - 1 && (r = read(fd, buf + got, len - 1 - got)) > 0) {
+        got += r;
+    }
+    buf[got] = '\0';
+    close(fd);
+    return n;
+}
+
+SystemTest(heap_profile, ((const char *[]){})) {
+    extern size_t mymalloc_sample_interval;
+    enum { N = 4096, SIZE = 1024 };
+    static void *ptrs[N];
+    static char buf[1 << 20];
+    mymalloc_sample_interval = 16 * 1024;
+
+    // Run down the countdown started at the default interval
+    for (int i = 0; i < N; i++) {
+        ptrs[i] = mymalloc(SIZE);
+    }
+    for (int i = 0; i < N; i++) {
+        myfree(ptrs[i]);
+    }
+    tk_assert(dump_profile(MYMALLOC_PROFILE_FOLDED, buf, sizeof(buf)) == 0,
+              "freed blocks leave the profile");
+
+    for (int i = 0; i < N; i++) {
+        ptrs[i] = mymalloc(SIZE);
+    }
+    long samples = dump_profile(MYMALLOC_PROFILE_FOLDED, buf, sizeof(buf));
+    tk_assert(samples > 100, "live blocks are sampled");
+    double estimate = 0;
+    int lines = 0;
+    for (char *line = buf; *line; lines++) {
+        char *end = strchr(line, '\n');
+        tk_assert(end != NULL, "every sample is a whole line");
+        *end = '\0';
+        char *bytes = strrchr(line, ' ');
+        tk_assert(bytes != NULL && bytes > line, "a sample has frames and a byte count");
+        estimate += strtod(bytes + 1, NULL);
+        line = end + 1;
+    }
+    tk_assert(lines == samples, "one line per sample");
+    tk_assert(estimate > 0.75 * N * SIZE && estimate < 1.25 * N * SIZE,
+              "the samples stand for the live bytes");
+
+    dump_profile(MYMALLOC_PROFILE_PPROF, buf, sizeof(buf));
+    tk_assert(strncmp(buf, "heap profile: ", 14) == 0 && strstr(buf, "@ heap_v2/16384\n") &&
+              strstr(buf, "\nMAPPED_LIBRARIES:\n"), "pprof header and memory map");
+
+    for (int i = 0; i < N; i++) {
+        myfree(ptrs[i]);
+    }
+    tk_assert(dump_profile(MYMALLOC_PROFILE_PPROF, buf, sizeof(buf)) == 0,
+              "freed blocks leave the profile");
+}
+
 // Thread safety validation
 typedef struct {
     int thread_id;
@@ -5,6 +5,10 @@
 #include <mymalloc.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 // Get current time in microseconds
 static long long get_time_us() {
@@ -149,6 +153,219 @@ SystemTest(multi_thread_performance, ((const char *[]){})) {
     tk_assert(1, "performance test completed");
 }
 
+// Throughput at 1, 2, 4 and 8 threads running the same worker; with the
+// per-thread caches this should grow with the number of cores.
+SystemTest(thread_scaling, ((const char *[]){})) {
+    const int ops_per_thread = 4000;
+    int counts[] = {1, 2, 4, 8};
+
+    for (int k = 0; k < 4; k++) {
+        int num_threads = counts[k];
+        pthread_t threads[8];
+        perf_thread_data_t thread_data[8];
+
+        long long start = get_time_us();
+        for (int i = 0; i < num_threads; i++) {
+            thread_data[i].thread_id = i;
+            thread_data[i].operations = ops_per_thread;
+            thread_data[i].duration = 0;
+            int ret = pthread_create(&threads[i], NULL, perf_worker, &thread_data[i]);
+            tk_assert(ret == 0, "thread creation should succeed");
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        long long duration = get_time_us() - start;
+        if (duration == 0) duration = 1;
+
+        if (getenv("TK_VERBOSE")) {
+            printf("Scaling %d threads: %lld us (%.2f ops/sec)\n", num_threads,
+                   duration, (double)num_threads * ops_per_thread * 1000000.0 / duration);
+        }
+    }
+}
+
+// Producer/consumer pairs: one thread allocates, the other frees, passing
+// pointers through a single-producer single-consumer ring. Every free is a
+// cross-thread free.
+#define PC_RING  256
+#define PC_ITEMS 100000
+
+typedef struct {
+    void *slots[PC_RING];
+    atomic_long head;  // next slot the producer fills
+    atomic_long tail;  // next slot the consumer empties
+    int corrupted;
+} pc_ring_t;
+
+static void *pc_producer(void *arg) {
+    pc_ring_t *ring = arg;
+    for (long i = 0; i < PC_ITEMS; i++) {
+        size_t size = 16 + (i % 16) * 16;
+        unsigned char *p = mymalloc(size);
+        if (p) {
+            p[0] = p[size - 1] = (unsigned char)i;
+        }
+        while (i - atomic_load_explicit(&ring->tail, memory_order_acquire) >= PC_RING) {
+            sched_yield();
+        }
+        ring->slots[i % PC_RING] = p;
+        atomic_store_explicit(&ring->head, i + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *pc_consumer(void *arg) {
+    pc_ring_t *ring = arg;
+    for (long i = 0; i < PC_ITEMS; i++) {
+        while (atomic_load_explicit(&ring->head, memory_order_acquire) <= i) {
+            sched_yield();
+        }
+        unsigned char *p = ring->slots[i % PC_RING];
+        size_t size = 16 + (i % 16) * 16;
+        if (p && (p[0] != (unsigned char)i || p[size - 1] != (unsigned char)i)) {
+            ring->corrupted = 1;
+        }
+        atomic_store_explicit(&ring->tail, i + 1, memory_order_release);
+        myfree(p);
+    }
+    return NULL;
+}
+
+SystemTest(producer_consumer, ((const char *[]){})) {
+    const int num_pairs = 2;
+    pthread_t producers[num_pairs], consumers[num_pairs];
+    static pc_ring_t rings[2];
+
+    long long start = get_time_us();
+    for (int i = 0; i < num_pairs; i++) {
+        atomic_store(&rings[i].head, 0);
+        atomic_store(&rings[i].tail, 0);
+        rings[i].corrupted = 0;
+        tk_assert(pthread_create(&producers[i], NULL, pc_producer, &rings[i]) == 0,
+                  "thread creation should succeed");
+        tk_assert(pthread_create(&consumers[i], NULL, pc_consumer, &rings[i]) == 0,
+                  "thread creation should succeed");
+    }
+    for (int i = 0; i < num_pairs; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+        tk_assert(!rings[i].corrupted, "objects should arrive intact");
+    }
+    long long duration = get_time_us() - start;
+    if (duration == 0) duration = 1;
+
+    tk_assert(duration < 10000000, "producer/consumer should complete within 10 seconds");
+    if (getenv("TK_VERBOSE")) {
+        printf("Producer/consumer %d pairs: %lld us (%.2f ops/sec)\n", num_pairs, duration,
+               (double)num_pairs * PC_ITEMS * 2 * 1000000.0 / duration);
+    }
+}
+
+// A thread whose bins never run dry still takes back what other threads
+// freed for it: here the owner keeps reusing one cached object while its
+// earlier objects sit on its remote list.
+#define RC_OBJS 64
+
+static void *rc_free_all(void *arg) {
+    void **objs = arg;
+    for (int i = 0; i < RC_OBJS; i++) {
+        myfree(objs[i]);
+    }
+    return NULL;
+}
+
+static void *rc_owner(void *arg) {
+    void *objs[RC_OBJS];
+    int *seen = arg;
+    for (int i = 0; i < RC_OBJS; i++) {
+        objs[i] = mymalloc(64);
+    }
+    void *keep = mymalloc(64);
+    pthread_t t;
+    if (pthread_create(&t, NULL, rc_free_all, objs) != 0) {
+        return NULL;
+    }
+    pthread_join(t, NULL);
+    myfree(keep);
+
+    for (int round = 0; round < 4 * RC_OBJS && !*seen; round++) {
+        void *p = mymalloc(64);
+        for (int i = 0; i < RC_OBJS; i++) {
+            if (p == objs[i]) {
+                *seen = 1;
+            }
+        }
+        myfree(p);
+    }
+    return NULL;
+}
+
+SystemTest(remote_frees_reclaimed, ((const char *[]){})) {
+    int seen = 0;
+    pthread_t t;
+    tk_assert(pthread_create(&t, NULL, rc_owner, &seen) == 0,
+              "thread creation should succeed");
+    pthread_join(t, NULL);
+    tk_assert(seen, "objects freed by another thread should be reused by their owner");
+}
+
+// Resident set size in KiB
+static long rss_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Phased workload: a burst of medium blocks, then most of them freed. A
+// few survivors pin every chunk, so only purging can bring RSS back down.
+SystemTest(purge_rss, ((const char *[]){})) {
+    extern long purge_interval_ms;
+    const int n = 2048;
+    const size_t size = 16 * 1024;
+    static char *ptrs[2048];
+
+    for (int round = 0; round < 2; round++) {
+        // Round 0 purges by hand, round 1 through the decay timer
+        purge_interval_ms = round == 0 ? 0 : 50;
+        long base = rss_kb();
+        for (int i = 0; i < n; i++) {
+            ptrs[i] = mymalloc(size);
+            tk_assert(ptrs[i] != NULL, "allocation should succeed");
+            memset(ptrs[i], 1, size);
+        }
+        long peak = rss_kb();
+        for (int i = 0; i < n; i++) {
+            if (i % 32 != 0) myfree(ptrs[i]);
+        }
+        long idle = rss_kb();
+
+        if (round == 0) {
+            tk_assert(mymalloc_purge() > 0, "purge should release pages");
+        } else {
+            usleep(100 * 1000);
+            char *p = mymalloc(size);  // any heap free triggers the check
+            myfree(p);
+        }
+        long purged = rss_kb();
+        for (int i = 0; i < n; i += 32) {
+            tk_assert(ptrs[i][0] == 1 && ptrs[i][size - 1] == 1, "live blocks should be intact");
+            myfree(ptrs[i]);
+        }
+
+        tk_assert(purged < idle - (idle - base) / 2, "purging should return most free pages");
+        if (getenv("TK_VERBOSE")) {
+            printf("RSS (%s): start %ld KiB, peak %ld, after free %ld, after purge %ld\n",
+                   round == 0 ? "manual" : "decay", base, peak, idle, purged);
+        }
+    }
+    purge_interval_ms = 1000;
+}
+
 // Memory fragmentation test
 SystemTest(fragmentation_test, ((const char *[]){})) {
     const int num_blocks = 50;
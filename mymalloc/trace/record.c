@@ -0,0 +1,246 @@
+// Allocation trace recorder: an LD_PRELOAD library that logs every
+// malloc/free of a program in the format of trace.h.
+//
+//   make libmytrace.so
+//   MYMALLOC_TRACE=app.trace LD_PRELOAD=$PWD/libmytrace.so ./program
+//
+// The calls themselves go to glibc through its __libc_* entry points, so
+// there is no dlsym() bootstrap. Events are buffered per thread in
+// mmap()ed memory and written out with write(2) under a mutex whenever a
+// buffer fills, when its thread exits and at process exit; recording never
+// allocates. Allocations made by the recorder's own libc calls (e.g.
+// pthread_setspecific()) are forwarded without being logged.
+//
+// Forked children stop recording: they would share the parent's file.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+#define TRACE_BUF_EVENTS 4096
+
+typedef struct trace_buf {
+    struct trace_event events[TRACE_BUF_EVENTS];
+    int count;
+    uint32_t thread;
+    struct trace_buf *next;  // all buffers, for the flush at exit
+} trace_buf;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static int trace_fd = -1;
+static atomic_int recording = 1;
+static atomic_uint nr_threads;
+static trace_buf *buffers;  // guarded by trace_lock
+
+static __thread trace_buf *my_buf;
+static __thread uint32_t my_thread;  // index + 1, kept if the buffer is
+                                     // recreated by a later TLS destructor
+static __thread int in_recorder;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Called with trace_lock held.
+static void flush_buf(trace_buf *b) {
+    const char *p = (const char *)b->events;
+    size_t left = b->count * sizeof(struct trace_event);
+    while (left && trace_fd >= 0) {
+        ssize_t n = write(trace_fd, p, left);
+        if (n <= 0) {
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    b->count = 0;
+}
+
+static void thread_exit(void *arg) {
+    trace_buf *b = arg;
+    pthread_mutex_lock(&trace_lock);
+    flush_buf(b);
+    for (trace_buf **pp = &buffers; *pp; pp = &(*pp)->next) {
+        if (*pp == b) {
+            *pp = b->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    munmap(b, sizeof(*b));
+    my_buf = NULL;
+}
+
+static void fork_child(void) {
+    atomic_store(&recording, 0);
+}
+
+static void trace_init(void) {
+    const char *path = getenv("MYMALLOC_TRACE");
+    trace_fd = open(path ? path : "mymalloc.trace",
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        atomic_store(&recording, 0);
+        return;
+    }
+    struct trace_header hdr = {.event_size = sizeof(struct trace_event)};
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        atomic_store(&recording, 0);
+        return;
+    }
+    pthread_key_create(&trace_key, thread_exit);
+    pthread_atfork(NULL, NULL, fork_child);
+}
+
+// Flushes the threads that are still running too; anything they log after
+// this point is lost.
+__attribute__((destructor))
+static void trace_fini(void) {
+    atomic_store(&recording, 0);
+    pthread_mutex_lock(&trace_lock);
+    for (trace_buf *b = buffers; b; b = b->next) {
+        flush_buf(b);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static trace_buf *thread_buf(void) {
+    if (my_buf) {
+        return my_buf;
+    }
+    pthread_once(&trace_once, trace_init);
+    if (!atomic_load(&recording)) {
+        return NULL;
+    }
+    trace_buf *b = mmap(NULL, sizeof(*b), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) {
+        return NULL;
+    }
+    if (!my_thread) {
+        my_thread = atomic_fetch_add(&nr_threads, 1) + 1;
+    }
+    b->thread = my_thread - 1;
+    pthread_mutex_lock(&trace_lock);
+    b->next = buffers;
+    buffers = b;
+    pthread_mutex_unlock(&trace_lock);
+    pthread_setspecific(trace_key, b);
+    my_buf = b;
+    return b;
+}
+
+static void record(int op, uint64_t time, void *ptr, void *old, size_t size) {
+    if (in_recorder || !atomic_load_explicit(&recording, memory_order_relaxed)) {
+        return;
+    }
+    in_recorder = 1;
+    trace_buf *b = thread_buf();
+    if (b) {
+        b->events[b->count++] = (struct trace_event){
+            .time_ns = time,
+            .ptr = (uintptr_t)ptr,
+            .old = (uintptr_t)old,
+            .size = size,
+            .thread = b->thread,
+            .op = op,
+        };
+        if (b->count == TRACE_BUF_EVENTS) {
+            pthread_mutex_lock(&trace_lock);
+            flush_buf(b);
+            pthread_mutex_unlock(&trace_lock);
+        }
+    }
+    in_recorder = 0;
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (ptr) {
+        record(TRACE_MALLOC, now_ns(), ptr, NULL, size);
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr) {
+        record(TRACE_FREE, now_ns(), ptr, NULL, 0);
+    }
+    __libc_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *ptr = __libc_calloc(nmemb, size);
+    if (ptr) {
+        record(TRACE_CALLOC, now_ns(), ptr, NULL, nmemb * size);
+    }
+    return ptr;
+}
+
+// ptr may be handed out to another thread before realloc() returns, and
+// the result may have been freed by another thread just before the call,
+// so the call is logged on both sides (see trace.h). A failed realloc is
+// logged too: it leaves ptr live, which the replay has to know.
+void *realloc(void *ptr, size_t size) {
+    record(TRACE_REALLOC_BEGIN, now_ns(), NULL, ptr, size);
+    void *res = __libc_realloc(ptr, size);
+    record(TRACE_REALLOC, now_ns(), res, ptr, size);
+    return res;
+}
+
+static void *aligned(size_t alignment, size_t size) {
+    void *ptr = __libc_memalign(alignment, size);
+    if (ptr) {
+        record(TRACE_MEMALIGN, now_ns(), ptr, (void *)alignment, size);
+    }
+    return ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+    void *ptr = aligned(alignment, size);
+    if (!ptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return aligned(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return aligned(page, (size + page - 1) & ~(page - 1));
+}
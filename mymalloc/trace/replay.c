@@ -0,0 +1,472 @@
+// Allocation trace replay driver.
+//
+//   make replay
+//   ./replay app.trace glibc
+//   LD_PRELOAD=$PWD/libmymalloc.so ./replay app.trace mymalloc
+//   LD_PRELOAD=/usr/lib/x86_64-linux-gnu/libjemalloc.so.2 ./replay app.trace jemalloc
+//
+// The driver calls plain malloc()/free(), so the allocator under test is
+// whatever the dynamic linker resolves them to. Each recorded thread is
+// replayed by a thread of its own, in its recorded order. Recorded
+// addresses are turned into slots first (addresses are reused, slots are
+// not); an operation on a block allocated by another thread waits until
+// that thread has allocated it. Frees of blocks the trace never allocated
+// are dropped.
+//
+// The driver's own memory comes from mmap(), so the allocator under test
+// only sees the trace. Every allocation is touched once per page right
+// after it is made, so peak RSS reflects what the program really used.
+// The touching stays out of the per-operation latencies but not out of
+// ops/sec: the page faults it takes are part of an allocator's cost, and
+// one that recycles pages takes fewer of them.
+//
+// Reports ops/sec over the whole replay (wall clock, page touching and
+// cross-thread waits included), p50/p99/p999 latency per operation (from a
+// log-linear histogram, within ~2%) and peak RSS during the replay alone,
+// over the driver's own resident set at its start.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define NO_SLOT     UINT32_MAX
+#define MAX_THREADS 1024
+#define PAGE        4096
+
+// Slot states, besides the block's address.
+#define SLOT_PENDING 0
+#define SLOT_FAILED  1
+
+// 64 sub-buckets per power of two: values below 64 ns are exact, the rest
+// within 1/64.
+#define HIST_SUB     64
+#define HIST_BUCKETS (59 * HIST_SUB + HIST_SUB)
+
+enum { OP_ALLOC, OP_FREE, OP_REALLOC, NR_OPS };
+static const char *op_names[NR_OPS] = {"malloc", "free", "realloc"};
+
+typedef struct {
+    uint8_t op;      // TRACE_*
+    uint32_t slot;   // block produced (alloc, realloc) or freed
+    uint32_t old;    // TRACE_REALLOC: block consumed, or NO_SLOT
+    uint64_t size;
+    uint64_t align;  // TRACE_MEMALIGN
+} replay_op;
+
+typedef struct {
+    replay_op *ops;
+    size_t nr_ops, cap;
+    uint64_t hist[NR_OPS][HIST_BUCKETS];
+    uint64_t count[NR_OPS];
+} replay_thread;
+
+static _Atomic uintptr_t *slots;
+static replay_thread *threads;
+static uint32_t nr_threads;
+static pthread_barrier_t start_barrier;
+
+static void *map(size_t size) {
+    void *p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);  // >= 6
+    return (e - 5) * HIST_SUB + ((v >> (e - 6)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int b) {
+    if (b < HIST_SUB) {
+        return b;
+    }
+    int e = b / HIST_SUB + 5;
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - 6);
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double q) {
+    uint64_t rank = (uint64_t)(q * total), seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > rank) {
+            return hist_value(b);
+        }
+    }
+    return 0;
+}
+
+// Stable merge sort of event indices by timestamp.
+static void sort_events(uint32_t *idx, uint32_t *tmp, size_t n,
+                        const struct trace_event *ev) {
+    if (n < 2) {
+        return;
+    }
+    size_t mid = n / 2;
+    sort_events(idx, tmp, mid, ev);
+    sort_events(idx + mid, tmp, n - mid, ev);
+    if (ev[idx[mid - 1]].time_ns <= ev[idx[mid]].time_ns) {
+        return;  // already in order, the common case within a batch
+    }
+    size_t i = 0, j = mid, k = 0;
+    while (i < mid && j < n) {
+        tmp[k++] = ev[idx[j]].time_ns < ev[idx[i]].time_ns ? idx[j++] : idx[i++];
+    }
+    while (i < mid) {
+        tmp[k++] = idx[i++];
+    }
+    memcpy(idx, tmp, k * sizeof(*idx));  // idx[j..n) is already in place
+}
+
+// Live recorded addresses -> slot, linear probing with backward-shift
+// deletion.
+static uint64_t *tab_key;
+static uint32_t *tab_val;
+static size_t tab_mask;
+static size_t tab_clashes;  // puts of an address that was still live
+
+static size_t tab_hash(uint64_t key) {
+    return (key * 0x9e3779b97f4a7c15ull >> 20) & tab_mask;
+}
+
+// An address that is still live means the trace is out of order: its
+// free was stamped after the new allocation. The new block takes over the
+// address, the old one is never freed, and the clash is reported.
+static void tab_put(uint64_t key, uint32_t val) {
+    size_t i = tab_hash(key);
+    while (tab_key[i] && tab_key[i] != key) {
+        i = (i + 1) & tab_mask;
+    }
+    if (tab_key[i]) {
+        tab_clashes++;
+    }
+    tab_key[i] = key;
+    tab_val[i] = val;
+}
+
+static uint32_t tab_take(uint64_t key) {
+    size_t i = tab_hash(key);
+    while (tab_key[i] != key) {
+        if (!tab_key[i]) {
+            return NO_SLOT;
+        }
+        i = (i + 1) & tab_mask;
+    }
+    uint32_t val = tab_val[i];
+    for (size_t j = (i + 1) & tab_mask; tab_key[j]; j = (j + 1) & tab_mask) {
+        size_t home = tab_hash(tab_key[j]);
+        // Move j into the hole at i unless its home lies in (i, j].
+        if (((j - home) & tab_mask) >= ((j - i) & tab_mask)) {
+            tab_key[i] = tab_key[j];
+            tab_val[i] = tab_val[j];
+            i = j;
+        }
+    }
+    tab_key[i] = 0;
+    return val;
+}
+
+static void push_op(replay_thread *t, replay_op op) {
+    if (t->nr_ops == t->cap) {
+        size_t cap = t->cap ? 2 * t->cap : 1024;
+        replay_op *ops = map(cap * sizeof(*ops));
+        memcpy(ops, t->ops, t->nr_ops * sizeof(*ops));
+        if (t->ops) {
+            munmap(t->ops, t->cap * sizeof(*ops));
+        }
+        t->ops = ops;
+        t->cap = cap;
+    }
+    t->ops[t->nr_ops++] = op;
+}
+
+// Turns the events into per-thread slot operations; returns the number of
+// slots.
+static uint32_t build(const struct trace_event *ev, size_t n) {
+    uint32_t *idx = map(n * sizeof(*idx)), *tmp = map(n * sizeof(*tmp));
+    for (size_t i = 0; i < n; i++) {
+        idx[i] = i;
+        if (ev[i].thread >= nr_threads) {
+            nr_threads = ev[i].thread + 1;
+        }
+    }
+    if (nr_threads > MAX_THREADS) {
+        fprintf(stderr, "too many threads in trace: %u\n", nr_threads);
+        exit(1);
+    }
+    sort_events(idx, tmp, n, ev);
+    munmap(tmp, n * sizeof(*tmp));
+
+    for (tab_mask = 1024; tab_mask < 2 * n; tab_mask *= 2)
+        ;
+    tab_key = map(tab_mask * sizeof(*tab_key));
+    tab_val = map(tab_mask * sizeof(*tab_val));
+    tab_mask--;
+
+    threads = map(nr_threads * sizeof(*threads));
+    // Per thread, the block its realloc in progress consumed
+    uint32_t *realloc_old = map(nr_threads * sizeof(*realloc_old));
+    memset(realloc_old, 0xff, nr_threads * sizeof(*realloc_old));  // NO_SLOT
+    uint32_t nr_slots = 0;
+    for (size_t i = 0; i < n; i++) {
+        const struct trace_event *e = &ev[idx[i]];
+        replay_op op = {.op = e->op, .slot = NO_SLOT, .old = NO_SLOT,
+                        .size = e->size};
+        switch (e->op) {
+        case TRACE_MEMALIGN:
+            op.align = e->old;
+            // fall through
+        case TRACE_MALLOC:
+        case TRACE_CALLOC:
+            op.slot = nr_slots++;
+            tab_put(e->ptr, op.slot);
+            break;
+        case TRACE_FREE:
+            op.slot = tab_take(e->ptr);
+            if (op.slot == NO_SLOT) {
+                continue;
+            }
+            break;
+        case TRACE_REALLOC_BEGIN:
+            realloc_old[e->thread] = e->old ? tab_take(e->old) : NO_SLOT;
+            continue;
+        case TRACE_REALLOC:
+            op.old = realloc_old[e->thread];
+            realloc_old[e->thread] = NO_SLOT;
+            if (e->ptr) {
+                op.slot = nr_slots++;
+                tab_put(e->ptr, op.slot);
+            } else if (e->size && op.old != NO_SLOT) {
+                // Failed: the old block is still live
+                tab_put(e->old, op.old);
+                continue;
+            } else if (op.old == NO_SLOT) {
+                continue;
+            }
+            break;
+        default:
+            fprintf(stderr, "bad event %zu: op %d\n", (size_t)idx[i], e->op);
+            exit(1);
+        }
+        push_op(&threads[e->thread], op);
+    }
+    munmap(realloc_old, nr_threads * sizeof(*realloc_old));
+    munmap(idx, n * sizeof(*idx));
+    munmap(tab_key, (tab_mask + 1) * sizeof(*tab_key));
+    munmap(tab_val, (tab_mask + 1) * sizeof(*tab_val));
+    return nr_slots;
+}
+
+// Waits until the block in `slot` has been allocated, possibly by another
+// replay thread; returns it, or NULL if that allocation failed.
+static void *wait_slot(uint32_t slot) {
+    uintptr_t p;
+    while ((p = atomic_load_explicit(&slots[slot], memory_order_acquire)) ==
+           SLOT_PENDING) {
+        sched_yield();
+    }
+    return p == SLOT_FAILED ? NULL : (void *)p;
+}
+
+static void publish(uint32_t slot, void *p, uint64_t size) {
+    if (p) {
+        for (uint64_t off = 0; off < size; off += PAGE) {
+            ((volatile char *)p)[off] = 1;
+        }
+    }
+    atomic_store_explicit(&slots[slot], p ? (uintptr_t)p : SLOT_FAILED,
+                          memory_order_release);
+}
+
+static void *replay_thread_fn(void *arg) {
+    replay_thread *t = arg;
+    pthread_barrier_wait(&start_barrier);
+    for (size_t i = 0; i < t->nr_ops; i++) {
+        replay_op *op = &t->ops[i];
+        void *p = NULL, *old = NULL;
+        int kind = OP_ALLOC;
+        if (op->op == TRACE_FREE) {
+            old = wait_slot(op->slot);
+            kind = OP_FREE;
+        } else if (op->op == TRACE_REALLOC) {
+            old = op->old != NO_SLOT ? wait_slot(op->old) : NULL;
+            kind = OP_REALLOC;
+        }
+
+        uint64_t start = now_ns();
+        switch (op->op) {
+        case TRACE_MALLOC:
+            p = malloc(op->size);
+            break;
+        case TRACE_CALLOC:
+            p = calloc(1, op->size);
+            break;
+        case TRACE_MEMALIGN:
+            if (posix_memalign(&p, op->align, op->size)) {
+                p = NULL;
+            }
+            break;
+        case TRACE_REALLOC:
+            p = realloc(old, op->size);
+            break;
+        case TRACE_FREE:
+            free(old);
+            break;
+        }
+        uint64_t lat = now_ns() - start;
+        t->hist[kind][hist_bucket(lat)]++;
+        t->count[kind]++;
+
+        if (op->slot != NO_SLOT && op->op != TRACE_FREE) {
+            publish(op->slot, p, op->size);
+        }
+    }
+    return NULL;
+}
+
+// A "Name:   123 kB" line of /proc/self/status, in KiB, or -1.
+static long status_kb(const char *name) {
+    char line[256];
+    long kb = -1;
+    size_t len = strlen(name);
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, name, len) && line[len] == ':') {
+            kb = strtol(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+// Start a new peak RSS (VmHWM) window. build() held the whole trace and
+// its indexes at once, so the peak so far says nothing about the allocator.
+static int reset_peak_rss(void) {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = write(fd, "5", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s TRACE [LABEL]\n", argv[0]);
+        return 1;
+    }
+    const char *label = argc > 2 ? argv[2] : "default";
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: not a trace\n", argv[1]);
+        return 1;
+    }
+    const char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const struct trace_header *hdr = (const void *)file;
+    if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->event_size != sizeof(struct trace_event)) {
+        fprintf(stderr, "%s: not a trace\n", argv[1]);
+        return 1;
+    }
+    const struct trace_event *ev = (const void *)(hdr + 1);
+    size_t n = (st.st_size - sizeof(*hdr)) / sizeof(*ev);
+
+    uint32_t nr_slots = build(ev, n);
+    if (tab_clashes) {
+        fprintf(stderr, "%s: %zu allocations of a still-live address; "
+                "their older blocks are never freed\n", argv[1], tab_clashes);
+    }
+    munmap((void *)file, st.st_size);
+    close(fd);
+    slots = map((size_t)nr_slots * sizeof(*slots));
+    // Fault the slot table in now, so the replay's peak RSS is the allocator's
+    memset((void *)slots, SLOT_PENDING, (size_t)nr_slots * sizeof(*slots));
+
+    pthread_t tids[nr_threads];
+    pthread_barrier_init(&start_barrier, NULL, nr_threads + 1);
+    for (uint32_t i = 0; i < nr_threads; i++) {
+        pthread_create(&tids[i], NULL, replay_thread_fn, &threads[i]);
+    }
+    int windowed = reset_peak_rss();
+    long base_rss = status_kb("VmRSS");
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < nr_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    long peak_rss = windowed ? status_kb("VmHWM") : -1;
+    uint64_t hist[NR_OPS][HIST_BUCKETS] = {0}, count[NR_OPS] = {0}, total = 0;
+    for (uint32_t i = 0; i < nr_threads; i++) {
+        for (int k = 0; k < NR_OPS; k++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                hist[k][b] += threads[i].hist[k][b];
+            }
+            count[k] += threads[i].count[k];
+            total += threads[i].count[k];
+        }
+    }
+
+    printf("trace %s: %zu events, %u threads, allocator %s\n",
+           argv[1], n, nr_threads, label);
+    printf("%.0f ops/sec (%lu ops in %.3f s), ", total / secs,
+           (unsigned long)total, secs);
+    if (peak_rss >= 0 && base_rss >= 0) {
+        printf("peak RSS %ld KiB (+%ld KiB over the driver's own)\n",
+               peak_rss, peak_rss - base_rss);
+    } else {
+        printf("peak RSS unknown (no /proc/self/clear_refs)\n");
+    }
+    printf("%-8s %10s %10s %10s %10s\n", "op", "count", "p50 ns", "p99 ns",
+           "p999 ns");
+    for (int k = 0; k < NR_OPS; k++) {
+        if (!count[k]) {
+            continue;
+        }
+        printf("%-8s %10lu %10lu %10lu %10lu\n", op_names[k],
+               (unsigned long)count[k],
+               (unsigned long)percentile(hist[k], count[k], 0.50),
+               (unsigned long)percentile(hist[k], count[k], 0.99),
+               (unsigned long)percentile(hist[k], count[k], 0.999));
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+// Allocation trace format shared by the recorder (record.c) and the replay
+// driver (replay.c).
+//
+// A trace file is a trace_header followed by fixed-size trace_event
+// records. Each recorded thread's events appear in program order, but the
+// threads' batches are interleaved as they were flushed: sort by time_ns
+// to get the global order.
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "MMTRACE2"
+
+enum {
+    TRACE_MALLOC = 1,   // ptr = malloc(size)
+    TRACE_CALLOC,       // ptr = calloc(1, size)
+    TRACE_REALLOC,      // ptr = realloc(old, size)
+    TRACE_MEMALIGN,     // ptr = aligned allocation of size, alignment in old
+    TRACE_FREE,         // free(ptr)
+    TRACE_REALLOC_BEGIN,  // realloc(old, size) is about to release old
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t event_size;  // sizeof(struct trace_event), for sanity checks
+    uint32_t pad;
+};
+
+// Allocations are stamped after the call returns and frees before it is
+// made, so an address is always released before it can be handed out
+// again. A realloc both releases and hands out, so it is logged twice: a
+// TRACE_REALLOC_BEGIN stamped before the call and a TRACE_REALLOC stamped
+// after it, the latter with ptr 0 if the call failed or freed old.
+struct trace_event {
+    uint64_t time_ns;  // CLOCK_MONOTONIC
+    uint64_t ptr;      // block returned, or freed for TRACE_FREE
+    uint64_t old;      // TRACE_REALLOC: block passed in
+    uint64_t size;
+    uint32_t thread;   // recorder-assigned thread index, from 0
+    uint8_t op;
+    uint8_t pad[3];
+};